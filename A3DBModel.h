@@ -1,70 +1,307 @@
 #pragma once
 
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
-#include <fstream>
 
 #include "Vec.h"
 #include "Color.h"
+#include "MappedFile.h"
 #include "Model.h"
+#include "WorkerPool.h"
 
+// Text model format, one element per line:
+//
+//    vertex   <x> <y> <z>
+//    triangle <vertex index> <vertex index> <vertex index> <red> <green> <blue>
+//
+// Keywords are case-insensitive, and lines that start with anything else are skipped.
+//
+// The file is mapped into memory and split into chunks on line boundaries. A first pass counts
+// each chunk's vertices and triangles, so the second can parse every chunk straight into its
+// place in the model's arrays, in parallel.
+//
 // ReSharper disable once CppInconsistentNaming
 class A3DBModel
 {
 public:
+    // Throws std::runtime_error, with the file name and line number, if the file can't be read
+    // or something in it can't be parsed
     static std::unique_ptr<Model> load( const std::string& file_name )
     {
-        std::vector<Vec3f> vertices        ;
-        std::vector<Vec3i> indices         ;
-        std::vector<Color> triangle_colors ;
+        MappedFile file( file_name ) ;
 
-        std::ifstream in_file( file_name ) ;
+        if( !file.is_open() )
+            throw std::runtime_error( file_name + ": could not open the file" ) ;
 
-        if( !in_file.good() )
-            return nullptr ;
+        auto chunks = split_into_chunks( file.data(), file.size() ) ;
+        WorkerPool workers( std::min( chunks.size(), get_max_threads() ) ) ;
 
-        while( !in_file.eof() )
+        workers.parallel_for( chunks.size(), [ & ]( size_t i, size_t )
         {
-            std::string object ;
-            in_file >> object ;
+            count_lines( chunks[ i ] ) ;
+        } ) ;
 
-            if( ! in_file.eof() && ! in_file.good() )
-                return nullptr ;
+        size_t line_count     = 0 ;
+        size_t vertex_count   = 0 ;
+        size_t triangle_count = 0 ;
 
-            if( ! _stricmp( object.c_str(), "vertex" ) )
-            {
-                float x, y, z ;
-                in_file >> x >> y >> z ;
+        for( auto& chunk : chunks )
+        {
+            chunk.first_line     = line_count + 1 ;
+            chunk.first_vertex   = vertex_count ;
+            chunk.first_triangle = triangle_count ;
+
+            line_count     += chunk.line_count ;
+            vertex_count   += chunk.vertex_count ;
+            triangle_count += chunk.triangle_count ;
+        }
+
+        std::vector<Vec3f> vertices ( vertex_count   ) ;
+        std::vector<Vec3i> indices  ( triangle_count ) ;
+        std::vector<Rgb>   colors   ( triangle_count ) ;
+
+        workers.parallel_for( chunks.size(), [ & ]( size_t i, size_t )
+        {
+            parse_chunk( chunks[ i ], vertex_count, vertices.data(), indices.data(), colors.data() ) ;
+        } ) ;
+
+        // Chunks are in file order, so this is the first error in the file
+        for( auto& chunk : chunks )
+        {
+            if( !chunk.error.empty() )
+                throw std::runtime_error( file_name + ":" + std::to_string( chunk.error_line ) + ": " + chunk.error ) ;
+        }
+
+        auto triangles = make_triangles( triangle_count, [ & ]( size_t i ) -> Triangle
+        {
+            return { indices[ i ], Color::custom( colors[ i ].r, colors[ i ].g, colors[ i ].b ) } ;
+        } ) ;
+
+        return std::make_unique<Model>( vertices, triangles ) ;
+    }
+
+private:
+    enum class LineKind { other, vertex, triangle } ;
+
+    class Rgb
+    {
+    public:
+        uint8_t r ;
+        uint8_t g ;
+        uint8_t b ;
+    } ;
+
+    // A run of whole lines, with where its lines, vertices and triangles start in the whole file
+    class Chunk
+    {
+    public:
+        const char* begin ;
+        const char* end   ;
+
+        size_t line_count     = 0 ;
+        size_t vertex_count   = 0 ;
+        size_t triangle_count = 0 ;
 
-                if( !in_file.good() )
-                    return nullptr ;
+        size_t first_line     = 0 ;
+        size_t first_vertex   = 0 ;
+        size_t first_triangle = 0 ;
 
-                vertices.push_back( { x, y, z } ) ;
+        // The first thing that went wrong in this chunk, if anything did
+        size_t      error_line = 0 ;
+        std::string error          ;
+    } ;
+
+    static size_t get_max_threads()
+    {
+        return std::max( 1u, std::thread::hardware_concurrency() ) ;
+    }
+
+    static std::vector<Chunk> split_into_chunks( const char* data, size_t size )
+    {
+        // Enough chunks for the threads to balance out, none so small they aren't worth a task
+        constexpr size_t min_chunk_size = 1 << 20 ;
+        auto chunk_count = std::max<size_t>( 1, std::min( size / min_chunk_size, get_max_threads() * 4 ) ) ;
+
+        std::vector<Chunk> chunks ;
+        auto begin = data ;
+        auto end   = data + size ;
+
+        for( size_t i = 1 ; i <= chunk_count ; ++i )
+        {
+            // Move each split to just after the next line break
+            auto split = i == chunk_count ? end : std::max( begin, data + size / chunk_count * i ) ;
+            if( split != end )
+            {
+                auto line_break = static_cast<const char*>( std::memchr( split, '\n', static_cast<size_t>( end - split ) ) ) ;
+                split = line_break != nullptr ? line_break + 1 : end ;
             }
 
-            if( ! _stricmp( object.c_str(), "triangle" ) )
+            Chunk chunk ;
+            chunk.begin = begin ;
+            chunk.end   = split ;
+            chunks.push_back( std::move( chunk ) ) ;
+
+            begin = split ;
+        }
+
+        return chunks ;
+    }
+
+    static void count_lines( Chunk& chunk )
+    {
+        for( auto line = chunk.begin ; line != chunk.end ; )
+        {
+            auto line_end = find_line_end( line, chunk.end ) ;
+
+            auto kind = read_keyword( line, line_end ) ;
+            if( kind == LineKind::vertex )
+                ++chunk.vertex_count ;
+            else if( kind == LineKind::triangle )
+                ++chunk.triangle_count ;
+
+            ++chunk.line_count ;
+            line = line_end == chunk.end ? chunk.end : line_end + 1 ;
+        }
+    }
+
+    static void parse_chunk( Chunk& chunk, size_t total_vertex_count, Vec3f* vertices, Vec3i* indices, Rgb* colors )
+    {
+        auto vertex   = vertices + chunk.first_vertex ;
+        auto triangle = chunk.first_triangle ;
+        auto line_number = chunk.first_line ;
+
+        for( auto line = chunk.begin ; line != chunk.end ; ++line_number )
+        {
+            auto line_end = find_line_end( line, chunk.end ) ;
+            auto cursor = line ;
+
+            switch( read_keyword( cursor, line_end ) )
             {
-                int x, y, z, r, g, b ;
-                in_file >> x >> y >> z >> r >> g >> b ;
+            case LineKind::vertex:
+                if( !read_number( cursor, line_end, vertex->x )
+                 || !read_number( cursor, line_end, vertex->y )
+                 || !read_number( cursor, line_end, vertex->z ) )
+                    return fail( chunk, line_number, "expected 3 coordinates after 'vertex'" ) ;
+
+                ++vertex ;
+                break ;
 
-                if( !in_file.good() )
-                    return nullptr ;
+            case LineKind::triangle:
+            {
+                int values[ 6 ] ;
+                for( auto& value : values )
+                {
+                    if( !read_number( cursor, line_end, value ) )
+                        return fail( chunk, line_number, "expected 3 vertex indices and 3 color components after 'triangle'" ) ;
+                }
 
-                indices.push_back( { x, y, z } ) ;
+                for( auto i = 0 ; i < 3 ; ++i )
+                {
+                    if( values[ i ] < 0 || static_cast<size_t>( values[ i ] ) >= total_vertex_count )
+                        return fail( chunk, line_number, "vertex index " + std::to_string( values[ i ] )
+                            + " is out of range, the model has " + std::to_string( total_vertex_count ) + " vertices" ) ;
+                }
 
-                triangle_colors.push_back( Color::custom(
-                    static_cast<uint8_t>( r ),
-                    static_cast<uint8_t>( g ),
-                    static_cast<uint8_t>( b ) ) ) ;
+                for( auto i = 3 ; i < 6 ; ++i )
+                {
+                    if( values[ i ] < 0 || values[ i ] > 255 )
+                        return fail( chunk, line_number, "color component " + std::to_string( values[ i ] )
+                            + " is outside of 0 to 255" ) ;
+                }
+
+                indices[ triangle ] = { values[ 0 ], values[ 1 ], values[ 2 ] } ;
+                colors[ triangle ]  = { static_cast<uint8_t>( values[ 3 ] ),
+                                        static_cast<uint8_t>( values[ 4 ] ),
+                                        static_cast<uint8_t>( values[ 5 ] ) } ;
+                ++triangle ;
+                break ;
+            }
 
+            case LineKind::other:
+                break ;
             }
+
+            line = line_end == chunk.end ? chunk.end : line_end + 1 ;
+        }
+    }
+
+    static void fail( Chunk& chunk, size_t line_number, std::string error )
+    {
+        chunk.error_line = line_number ;
+        chunk.error      = std::move( error ) ;
+    }
+
+    static const char* find_line_end( const char* line, const char* end )
+    {
+        auto line_break = static_cast<const char*>( std::memchr( line, '\n', static_cast<size_t>( end - line ) ) ) ;
+        return line_break != nullptr ? line_break : end ;
+    }
+
+    static bool is_space( char c )
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f' ;
+    }
+
+    static void skip_spaces( const char*& cursor, const char* line_end )
+    {
+        while( cursor != line_end && is_space( *cursor ) )
+            ++cursor ;
+    }
+
+    static LineKind read_keyword( const char*& cursor, const char* line_end )
+    {
+        skip_spaces( cursor, line_end ) ;
+
+        auto token = cursor ;
+        while( cursor != line_end && !is_space( *cursor ) )
+            ++cursor ;
+
+        auto length = static_cast<size_t>( cursor - token ) ;
+        if( equals_ignoring_case( token, length, "vertex" ) )
+            return LineKind::vertex ;
+        if( equals_ignoring_case( token, length, "triangle" ) )
+            return LineKind::triangle ;
+        return LineKind::other ;
+    }
+
+    static bool equals_ignoring_case( const char* token, size_t length, const char* keyword )
+    {
+        if( length != std::strlen( keyword ) )
+            return false ;
+
+        for( size_t i = 0 ; i < length ; ++i )
+        {
+            auto c = token[ i ] ;
+            if( c >= 'A' && c <= 'Z' )
+                c = static_cast<char>( c - 'A' + 'a' ) ;
+            if( c != keyword[ i ] )
+                return false ;
         }
+        return true ;
+    }
+
+    // Reads the next whitespace separated number on the line, which has to be nothing but the number
+    template <typename T>
+    static bool read_number( const char*& cursor, const char* line_end, T& value )
+    {
+        skip_spaces( cursor, line_end ) ;
+
+        // from_chars doesn't take a leading plus, the old stream based reader did
+        if( cursor != line_end && *cursor == '+' )
+            ++cursor ;
 
-        std::vector<Triangle> triangles ;
-        for( size_t i = 0 ; i < indices.size() ; ++i )
-            triangles.push_back( { indices[ i ], triangle_colors[ i ] } ) ;
+        auto result = std::from_chars( cursor, line_end, value ) ;
+        if( result.ec != std::errc() || ( result.ptr != line_end && !is_space( *result.ptr ) ) )
+            return false ;
 
-        return std::make_unique<Model>( Model { vertices, triangles } ) ;
+        cursor = result.ptr ;
+        return true ;
     }
 } ;
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// Allocator for std::vector that starts every block on an Alignment byte boundary, so SIMD code
+// can use aligned loads and stores on it
+template <typename T, size_t Alignment>
+class AlignedAllocator
+{
+public:
+	using value_type = T;
+
+	template <typename U>
+	struct rebind
+	{
+		using other = AlignedAllocator<U, Alignment>;
+	};
+
+	AlignedAllocator() = default;
+
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&)
+	{
+	}
+
+	T* allocate(size_t count)
+	{
+		// Over-allocate, round up to the boundary, and keep what operator new returned just in front
+		auto raw = static_cast<char*>(::operator new(count * sizeof(T) + Alignment + sizeof(void*)));
+		auto aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + Alignment - 1)
+			& ~static_cast<uintptr_t>(Alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<T*>(aligned);
+	}
+
+	void deallocate(T* pointer, size_t)
+	{
+		::operator delete(reinterpret_cast<void**>(pointer)[-1]);
+	}
+
+	template <typename U>
+	friend bool operator==(const AlignedAllocator&, const AlignedAllocator<U, Alignment>&)
+	{
+		return true;
+	}
+
+	template <typename U>
+	friend bool operator!=(const AlignedAllocator&, const AlignedAllocator<U, Alignment>&)
+	{
+		return false;
+	}
+};
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Vec.h"
+#include "Color.h"
+#include "MappedFile.h"
+#include "MeshOptimizer.h"
+#include "Meshlet.h"
+#include "Model.h"
+#include "Plane.h"
+
+// Compact binary mesh. Loading maps the file and copies each array once, straight into the
+// model, with nothing to parse and nothing worked out again: the bounding sphere, MeshOptimizer's
+// face planes and meshlets, and the levels of detail are all stored. Everything is little-endian:
+//
+//    offset    size    contents
+//         0       4    "A3MB"
+//         4       4    uint32 version
+//         8       4    uint32 vertex count, v
+//        12       4    uint32 triangle count, t
+//        16      16    bounding sphere: float center x, y, z, radius
+//        32       .    mesh
+//                   4    uint32 level of detail count
+//
+// Then each level of detail, from the finest to the coarsest:
+//
+//                   4    float error
+//                   4    uint32 vertex count, v
+//                   4    uint32 triangle count, t
+//                  16    bounding sphere
+//                   .    mesh
+//
+// Where each mesh, as it came out of MeshOptimizer, is:
+//
+//                12 v    vertices: float x, y, z
+//                12 t    triangles' vertex indices: int32 a, b, c
+//                 3 t    triangles' colors: uint8 r, g, b
+//                16 t    triangles' face planes: float normal x, y, z, distance
+//                   4    uint32 meshlet count, m
+//                40 m    meshlets: uint32 first triangle, triangle count, float bounds x, y, z,
+//                        radius, cone axis x, y, z, cone cutoff
+//
+// Version 2 files leave out the face planes and meshlets, which are worked out again on load.
+// Version 1 files also end before the level of detail count, and were written before meshes went
+// through MeshOptimizer, so they are optimized and simplified on load like a text model.
+class BinaryModel
+{
+public:
+    static constexpr uint32_t version = 3 ;
+
+    static std::unique_ptr<Model> load( const std::string& file_name )
+    {
+        if( !is_little_endian() )
+            return nullptr ;
+
+        MappedFile file( file_name ) ;
+
+        if( !file.is_open() || file.size() < sizeof( Header ) )
+            return nullptr ;
+
+        Header header ;
+        std::memcpy( &header, file.data(), sizeof( Header ) ) ;
+
+        if( std::memcmp( header.magic, "A3MB", 4 ) != 0 || header.version < 1 || header.version > version )
+            return nullptr ;
+
+        auto data = file.data() + sizeof( Header ) ;
+        auto end  = file.data() + file.size() ;
+
+        MeshOptimizer::Mesh mesh ;
+        if( !read_mesh( data, end, header.vertex_count, header.triangle_count, header.version, mesh ) )
+            return nullptr ;
+
+        if( header.version == 1 )
+        {
+            if( data != end )
+                return nullptr ;
+
+            return std::make_unique<Model>( mesh.vertices, mesh.triangles ) ;
+        }
+
+        Sphere bounding_sphere { { header.bounds[ 0 ], header.bounds[ 1 ], header.bounds[ 2 ] }, header.bounds[ 3 ] } ;
+
+        uint32_t lod_count ;
+        if( !read( data, end, &lod_count, sizeof( lod_count ) ) )
+            return nullptr ;
+
+        std::vector<Model::Lod> lods ;
+        for( uint32_t level = 0 ; level < lod_count ; ++level )
+        {
+            LodHeader lod_header ;
+            MeshOptimizer::Mesh lod_mesh ;
+            if( !read( data, end, &lod_header, sizeof( LodHeader ) )
+             || !read_mesh( data, end, lod_header.vertex_count, lod_header.triangle_count, header.version, lod_mesh ) )
+                return nullptr ;
+
+            Sphere lod_bounds { { lod_header.bounds[ 0 ], lod_header.bounds[ 1 ], lod_header.bounds[ 2 ] }, lod_header.bounds[ 3 ] } ;
+            lods.push_back( { make_model( header.version, std::move( lod_mesh ), lod_bounds, {} ), lod_header.error } ) ;
+        }
+
+        if( data != end )
+            return nullptr ;
+
+        return make_model( header.version, std::move( mesh ), bounding_sphere, std::move( lods ) ) ;
+    }
+
+    static bool save( const Model& model, const std::string& file_name )
+    {
+        if( !is_little_endian() )
+            return false ;
+
+        std::ofstream out_file( file_name, std::ios::binary | std::ios::trunc ) ;
+
+        if( !out_file.good() )
+            return false ;
+
+        Header header {} ;
+        std::memcpy( header.magic, "A3MB", 4 ) ;
+        header.version        = version ;
+        header.vertex_count   = static_cast<uint32_t>( model.vertices.size() ) ;
+        header.triangle_count = static_cast<uint32_t>( model.triangles.size() ) ;
+        header.bounds[ 0 ]    = model.bounding_sphere.center.x ;
+        header.bounds[ 1 ]    = model.bounding_sphere.center.y ;
+        header.bounds[ 2 ]    = model.bounding_sphere.center.z ;
+        header.bounds[ 3 ]    = model.bounding_sphere.radius ;
+
+        out_file.write( reinterpret_cast<const char*>( &header ), sizeof( Header ) ) ;
+        write_mesh( out_file, model ) ;
+
+        auto lod_count = static_cast<uint32_t>( model.lods.size() ) ;
+        out_file.write( reinterpret_cast<const char*>( &lod_count ), sizeof( lod_count ) ) ;
+
+        for( auto& lod : model.lods )
+        {
+            auto& lod_model = *lod.model ;
+            LodHeader lod_header {} ;
+            lod_header.error          = lod.error ;
+            lod_header.vertex_count   = static_cast<uint32_t>( lod_model.vertices.size() ) ;
+            lod_header.triangle_count = static_cast<uint32_t>( lod_model.triangles.size() ) ;
+            lod_header.bounds[ 0 ]    = lod_model.bounding_sphere.center.x ;
+            lod_header.bounds[ 1 ]    = lod_model.bounding_sphere.center.y ;
+            lod_header.bounds[ 2 ]    = lod_model.bounding_sphere.center.z ;
+            lod_header.bounds[ 3 ]    = lod_model.bounding_sphere.radius ;
+
+            out_file.write( reinterpret_cast<const char*>( &lod_header ), sizeof( LodHeader ) ) ;
+            write_mesh( out_file, lod_model ) ;
+        }
+
+        return out_file.good() ;
+    }
+
+private:
+    class Header
+    {
+    public:
+        char     magic[ 4 ]     ;
+        uint32_t version        ;
+        uint32_t vertex_count   ;
+        uint32_t triangle_count ;
+        float    bounds[ 4 ]    ;
+    } ;
+
+    class LodHeader
+    {
+    public:
+        float    error          ;
+        uint32_t vertex_count   ;
+        uint32_t triangle_count ;
+        float    bounds[ 4 ]    ;
+    } ;
+
+    static_assert( sizeof( Header ) == 32, "the header is 32 bytes on disk" ) ;
+    static_assert( sizeof( LodHeader ) == 28, "a level of detail's header is 28 bytes on disk" ) ;
+    static_assert( sizeof( Vec3f  ) == 12, "vertices are copied straight from the file" ) ;
+    static_assert( sizeof( Vec3i  ) == 12, "indices are copied straight from the file" ) ;
+    static_assert( sizeof( Plane  ) == 16, "face planes are copied straight from the file" ) ;
+    static_assert( sizeof( Meshlet ) == 40, "meshlets are copied straight from the file" ) ;
+
+    // The arrays are copied as they are, which is only right on a little-endian machine
+    static bool is_little_endian()
+    {
+        uint32_t one = 1 ;
+        uint8_t first_byte ;
+        std::memcpy( &first_byte, &one, 1 ) ;
+        return first_byte == 1 ;
+    }
+
+    static bool is_valid_index( int index, uint32_t vertex_count )
+    {
+        return index >= 0 && static_cast<uint32_t>( index ) < vertex_count ;
+    }
+
+    // Copies size bytes out and moves past them, unless the file ends first
+    static bool read( const char*& data, const char* end, void* output, uint64_t size )
+    {
+        if( static_cast<uint64_t>( end - data ) < size )
+            return false ;
+
+        if( size != 0 )
+            std::memcpy( output, data, static_cast<size_t>( size ) ) ;
+        data += size ;
+        return true ;
+    }
+
+    // Version 2 meshes come without their face planes and meshlets
+    static std::unique_ptr<Model> make_model( uint32_t file_version, MeshOptimizer::Mesh mesh, const Sphere& bounding_sphere,
+                                              std::vector<Model::Lod> lods )
+    {
+        if( file_version < 3 )
+            return std::make_unique<Model>( std::move( mesh.vertices ), std::move( mesh.triangles ), bounding_sphere, std::move( lods ) ) ;
+        return std::make_unique<Model>( std::move( mesh ), bounding_sphere, std::move( lods ) ) ;
+    }
+
+    // The mesh's arrays, checking that every index is in range and that the meshlets cover the
+    // triangles in order, without gaps
+    static bool read_mesh( const char*& data, const char* end, uint32_t vertex_count, uint32_t triangle_count,
+                           uint32_t file_version, MeshOptimizer::Mesh& mesh )
+    {
+        auto vertex_bytes = static_cast<uint64_t>( vertex_count   ) * sizeof( Vec3f ) ;
+        auto index_bytes  = static_cast<uint64_t>( triangle_count ) * sizeof( Vec3i ) ;
+        auto color_bytes  = static_cast<uint64_t>( triangle_count ) * 3 ;
+
+        if( static_cast<uint64_t>( end - data ) < vertex_bytes + index_bytes + color_bytes )
+            return false ;
+
+        mesh.vertices.resize( vertex_count ) ;
+        read( data, end, mesh.vertices.data(), vertex_bytes ) ;
+
+        // The file's arrays need not be aligned, so each index is copied out on its own
+        auto index_data = data ;
+        auto color_data = reinterpret_cast<const uint8_t*>( data + index_bytes ) ;
+        data += index_bytes + color_bytes ;
+
+        mesh.triangles = make_triangles( triangle_count, [ & ]( size_t i ) -> Triangle
+        {
+            Vec3i indices ;
+            std::memcpy( &indices, index_data + i * sizeof( Vec3i ), sizeof( Vec3i ) ) ;
+            auto color = color_data + i * 3 ;
+            return { indices, Color::custom( color[ 0 ], color[ 1 ], color[ 2 ] ) } ;
+        } ) ;
+
+        for( auto& triangle : mesh.triangles )
+        {
+            if( !is_valid_index( triangle.vertex_indices.x, vertex_count )
+             || !is_valid_index( triangle.vertex_indices.y, vertex_count )
+             || !is_valid_index( triangle.vertex_indices.z, vertex_count ) )
+                return false ;
+        }
+
+        if( file_version < 3 )
+            return true ;
+
+        uint32_t meshlet_count ;
+        mesh.face_planes.resize( triangle_count ) ;
+        if( !read( data, end, mesh.face_planes.data(), static_cast<uint64_t>( triangle_count ) * sizeof( Plane ) )
+         || !read( data, end, &meshlet_count, sizeof( meshlet_count ) )
+         || static_cast<uint64_t>( end - data ) < static_cast<uint64_t>( meshlet_count ) * sizeof( Meshlet ) )
+            return false ;
+
+        mesh.meshlets.resize( meshlet_count ) ;
+        read( data, end, mesh.meshlets.data(), static_cast<uint64_t>( meshlet_count ) * sizeof( Meshlet ) ) ;
+
+        uint32_t next_triangle = 0 ;
+        for( auto& meshlet : mesh.meshlets )
+        {
+            if( meshlet.first_triangle != next_triangle || meshlet.triangle_count == 0
+             || meshlet.triangle_count > Meshlet::max_triangles || meshlet.triangle_count > triangle_count - next_triangle )
+                return false ;
+            next_triangle += meshlet.triangle_count ;
+        }
+
+        return next_triangle == triangle_count ;
+    }
+
+    static void write_mesh( std::ofstream& out_file, const Model& model )
+    {
+        out_file.write( reinterpret_cast<const char*>( model.vertices.data() ),
+                        static_cast<std::streamsize>( model.vertices.size() * sizeof( Vec3f ) ) ) ;
+
+        for( auto& triangle : model.triangles )
+            out_file.write( reinterpret_cast<const char*>( &triangle.vertex_indices ), sizeof( Vec3i ) ) ;
+
+        for( auto& triangle : model.triangles )
+        {
+            char color[ 3 ] = { static_cast<char>( triangle.color.r ),
+                                static_cast<char>( triangle.color.g ),
+                                static_cast<char>( triangle.color.b ) } ;
+            out_file.write( color, 3 ) ;
+        }
+
+        out_file.write( reinterpret_cast<const char*>( model.face_planes.data() ),
+                        static_cast<std::streamsize>( model.face_planes.size() * sizeof( Plane ) ) ) ;
+
+        auto meshlet_count = static_cast<uint32_t>( model.meshlets.size() ) ;
+        out_file.write( reinterpret_cast<const char*>( &meshlet_count ), sizeof( meshlet_count ) ) ;
+        out_file.write( reinterpret_cast<const char*>( model.meshlets.data() ),
+                        static_cast<std::streamsize>( model.meshlets.size() * sizeof( Meshlet ) ) ) ;
+    }
+} ;
@@ -1,11 +1,23 @@
 #include "Canvas.h"
 
-// These clipping planes result in a 45 degree field of view
+// These clipping planes result in a 45 degree field of view. Their normals are unit length, so
+// plugging a point into a plane gives its actual distance, which the bounding sphere tests rely on.
 const Plane Canvas::clipping_planes[] =
 {
-    { {                   0,                   0,                  1 }, 1 }, // Near   clipping plane
-    { {  square_root_of_two,                   0, square_root_of_two }, 0 }, // Left   clipping plane
-    { { -square_root_of_two,                   0, square_root_of_two }, 0 }, // Right  clipping plane
-    { {                   0, -square_root_of_two, square_root_of_two }, 0 }, // Top    clipping plane
-    { {                   0,  square_root_of_two, square_root_of_two }, 0 }, // Bottom clipping plane
+    { {                       0,                       0,                       1 }, -1 }, // Near   clipping plane, at z = 1
+    { {  square_root_of_two / 2,                       0,  square_root_of_two / 2 },  0 }, // Left   clipping plane
+    { { -square_root_of_two / 2,                       0,  square_root_of_two / 2 },  0 }, // Right  clipping plane
+    { {                       0, -square_root_of_two / 2,  square_root_of_two / 2 },  0 }, // Top    clipping plane
+    { {                       0,  square_root_of_two / 2,  square_root_of_two / 2 },  0 }, // Bottom clipping plane
+} ;
+
+// The guard band's side planes, where x/z or y/z reaches 8 instead of 1. Far enough out that
+// hardly anything needs cutting, close enough that projected points stay well inside int range.
+// The normals are (1, 0, 8) and so on, normalized: 1/sqrt(65) and 8/sqrt(65).
+const Plane Canvas::guard_band_planes[] =
+{
+    { {  0.1240347346f,           0.0f, 0.9922778767f }, 0 }, // Left   guard band plane
+    { { -0.1240347346f,           0.0f, 0.9922778767f }, 0 }, // Right  guard band plane
+    { {           0.0f, -0.1240347346f, 0.9922778767f }, 0 }, // Top    guard band plane
+    { {           0.0f,  0.1240347346f, 0.9922778767f }, 0 }, // Bottom guard band plane
 } ;
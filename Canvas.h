@@ -1,42 +1,184 @@
 // ReSharper disable CppClangTidyReadabilitySuspiciousCallArgument
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <limits>
 #include <memory>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include "Mat.h"
 #include "Plane.h"
 #include "CanvasBase.h"
+#include "CommandBuffer.h"
+#include "DepthFormat.h"
+#include "HierarchicalZ.h"
 #include "ModelInstance.h"
+#include "OcclusionBuffer.h"
+#include "RasterizerEngine.h"
+#include "Scene.h"
+#include "HalfSpaceRasterizer.h"
+#include "TileGrid.h"
+#include "TiledLayout.h"
+#include "VertexTransform.h"
+#include "WorkerPool.h"
 
 class Canvas final : public CanvasBase
 {
-	struct CorrespondingCoordinateLists
+	// A projected triangle waiting for its tiles to be rasterized, in canvas coordinates
+	struct QueuedTriangle
 	{
-		std::vector<float> left{};
-		std::vector<float> right{};
+		Vec2f    points[3];
+		float    z[3];
+		uint32_t color;
+	};
+
+	// Buffers a worker reuses for every instance it clips, so they only grow during the first frames
+	struct GeometryScratch
+	{
+		//Camera space positions: the model's vertices first, then whatever the clipper adds
+		SoaVertices           vertices;
+		//Where the model's own vertices land on the canvas
+		SoaVertices::Array    projected_x;
+		SoaVertices::Array    projected_y;
+		std::vector<uint16_t> outcodes;
+		//Indices of the model's triangles that face the camera, and which batches of the model's
+		//vertices they use
+		std::vector<uint32_t> front_triangles;
+		std::vector<uint8_t>  used_batches;
+	};
+
+	// Where one instance's triangles ended up in draw_simple_models' per-worker lists
+	struct InstanceTriangles
+	{
+		size_t worker;
+		size_t first;
+		size_t last;
+	};
+
+	// A recorded draw with what execute sorts it by: its pass, then its depth, negated for
+	// blended draws so they go farthest first
+	struct SortedDraw
+	{
+		const ModelInstance* instance;
+		CommandBuffer::Pass pass;
+		float depth;
+	};
+
+	// An instance the occlusion buffer hid this frame, and its camera space bounding sphere
+	struct OccludedInstance
+	{
+		const ModelInstance* instance;
+		Vec3f center;
+		float radius;
 	};
 
 	static constexpr float viewport_size = 1.0;
 	static constexpr float projection_plane_z = 1.0;
 	static const     Plane clipping_planes[5];
+	static const     Plane guard_band_planes[4];
 
 public:
-	Canvas(const char* window_title, size_t width, size_t height)
-		: CanvasBase(window_title, width, height)
+	explicit Canvas(std::unique_ptr<CanvasBackend> backend)
+		: CanvasBase(std::move(backend))
 		, _camera_position(Vec3f{ 0, 0, 0 })
 		, _camera_orientation(Mat::get_identity_matrix())
 		, _camera_transform(Mat::get_identity_matrix())
+		, _layout(_width, _height)
+		, _hierarchical_z(_layout)
+		, _occlusion_buffer(_width, _height,
+			projection_plane_z * static_cast<float>(_width) / viewport_size,
+			projection_plane_z * static_cast<float>(_height) / viewport_size)
+		, _tiles(_width, _height)
+		, _workers(std::make_unique<WorkerPool>(std::max(1u, std::thread::hardware_concurrency())))
 	{
-		_depth_buffer = std::vector<float>(_width * _height, 0.0f);
-
+		_color_buffer.resize(_layout.get_size());
+		_tile_frames.assign(_layout.get_tile_count(), 0);
+		set_depth_format(DepthFormat::float32);
+		_worker_triangles.resize(_workers->get_thread_count());
+		_worker_scratch.resize(_workers->get_thread_count());
+		update_clipping_planes();
+		compose_camera_transform();
 	}
 
+	//Resets the frame without giving any memory back, so steady frames don't allocate. Nothing is
+	//filled here: moving on to the next frame marks every tile stale, and a tile is only cleared
+	//once something draws into it. Tiles nothing drew into are presented as the clear color.
 	void clear() override
 	{
-		CanvasBase::clear();
-		_depth_buffer = std::vector<float>(_width * _height, 0.0f);
+		if (++_frame == 0)
+		{
+			std::fill(_tile_frames.begin(), _tile_frames.end(), 0);
+			_frame = 1;
+		}
+
+		_frame_triangles.clear();
+		_tiles.clear();
+		for (auto& output : _worker_triangles)
+			output.clear();
+	}
+
+	//Draws the triangles queued so far, then copies the tiled colors out into the row-major frame
+	//buffer and moves that to screen. get_frame_buffer only has the frame in it from then on.
+	void present() override
+	{
+		flush();
+		if (_occlusion_culling)
+			capture_occlusion_buffer();
+
+		_workers->parallel_for(_layout.get_tile_count(), [this](size_t tile, size_t)
+		{
+			if (_tile_frames[tile] == _frame)
+				_layout.resolve_tile(tile, _color_buffer.data(), _frame_buffer.data());
+			else
+				_layout.fill_tile(tile, _clear_color, _frame_buffer.data());
+		});
+
+		CanvasBase::present();
+	}
+
+	//Into the tiled buffer the triangles are drawn in, so it shows up with the next present
+	void put_pixel(const Vec2i& pt, const Color& color) override
+	{
+		auto x = (static_cast<int>(_width) / 2) + pt.x;
+		auto y = (static_cast<int>(_height) / 2) - pt.y;
+
+		if (x < 0 || x >= static_cast<int>(_width) || y < 0 || y >= static_cast<int>(_height))
+			return;
+
+		prepare_tile(_layout.get_tile(x, y));
+		_color_buffer[_layout.get_offset(x, y)] = color.to_argb();
+	}
+
+	//Rasterizes everything queued since the last flush, one tile per task
+	void flush()
+	{
+		if (_frame_triangles.empty())
+			return;
+
+		_workers->parallel_for(_tiles.get_tile_count(), [this](size_t tile, size_t)
+		{
+			rasterize_tile(tile);
+		});
+
+		_frame_triangles.clear();
+		_tiles.clear();
+	}
+
+	//How many threads rasterize tiles and process instances, the calling thread included
+	void set_thread_count(size_t thread_count)
+	{
+		_workers = std::make_unique<WorkerPool>(thread_count);
+		_worker_triangles.resize(_workers->get_thread_count());
+		_worker_scratch.resize(_workers->get_thread_count());
+	}
+
+	size_t get_thread_count() const
+	{
+		return _workers->get_thread_count();
 	}
 
 	void set_camera_position(const Vec3f& position)
@@ -45,235 +187,922 @@ public:
 		compose_camera_transform();
 	}
 
+	//A rotation, or anything else that keeps the bottom row at (0, 0, 0, 1)
 	void set_camera_orientation(const Mat& orientation)
 	{
 		_camera_orientation = orientation;
 		compose_camera_transform();
 	}
 
-	void draw_simple_model(const ModelInstance& instance) 
+	//With the guard band on, triangles poking out past the sides of the screen are no longer cut
+	//at the side planes. They are drawn whole and the rasterizer's scissor drops what is off screen.
+	//Only the near (and far) planes still cut triangles, along with side planes far enough out
+	//that screen coordinates can't overflow.
+	void set_guard_band_clipping(bool enabled)
+	{
+		_guard_band_clipping = enabled;
+		update_clipping_planes();
+	}
+
+	bool get_guard_band_clipping() const
+	{
+		return _guard_band_clipping;
+	}
+
+	//Anything further away than this is clipped. Zero (the default) means there is no far plane.
+	void set_far_plane_distance(float distance)
+	{
+		_far_plane_distance = distance;
+		update_clipping_planes();
+	}
+
+	float get_far_plane_distance() const
+	{
+		return _far_plane_distance;
+	}
+
+	//Lets the two triangle fillers be compared on the same scene
+	void set_rasterizer_engine(RasterizerEngine engine)
 	{
-		auto overall_transform = _camera_transform * instance.get_transformation();
+		_rasterizer_engine = engine;
+	}
 
-		auto clipped_model = clip_model(instance, overall_transform);
+	RasterizerEngine get_rasterizer_engine() const
+	{
+		return _rasterizer_engine;
+	}
 
-		if (clipped_model == nullptr) //No model to draw, leave
+	//Changing it clears the depth buffer, so do it between frames. Tiles already drawn into this frame
+	//keep their colors, but nothing behind them is hidden any more.
+	void set_depth_format(DepthFormat format)
+	{
+		_depth_format = format;
+		_depth_buffers = {};
+		with_depth_format([this](auto depth)
+		{
+			get_depth_buffer<decltype(depth)>().assign(_layout.get_size(), typename decltype(depth)::Value{});
+		});
+		for (size_t tile = 0; tile < _layout.get_tile_count(); ++tile)
+			_hierarchical_z.clear_tile(tile);
+	}
+
+	DepthFormat get_depth_format() const
+	{
+		return _depth_format;
+	}
+
+	//How many pixels a model's simpler levels of detail may stray from it before they are drawn
+	//in its place. Below zero, models are always drawn in full.
+	void set_lod_pixel_error(float max_pixel_error)
+	{
+		_lod_pixel_error = max_pixel_error;
+	}
+
+	float get_lod_pixel_error() const
+	{
+		return _lod_pixel_error;
+	}
+
+	//Skips instances drawn with draw_simple_model(s) or draw_scene when the last frame's depths,
+	//moved over to the current camera, hide their bounding spheres. Whatever is hidden by mistake,
+	//say because what was in front of it has moved away, shows up a frame late. draw_instanced's
+	//copies are never tested, since there is nothing to remember them by from one frame to the next.
+	void set_occlusion_culling(bool enabled)
+	{
+		_occlusion_culling = enabled;
+	}
+
+	bool get_occlusion_culling() const
+	{
+		return _occlusion_culling;
+	}
+
+	void draw_simple_model(const ModelInstance& instance) 
+	{
+		auto& output = _worker_triangles[0];
+		output.clear();
+		auto& model_view = instance.get_model_view(_camera_transform, _camera_id);
+		auto model = select_lod(instance, model_view);
+		if (model != nullptr && is_occluded(instance, *model, model_view))
 			return;
 
-		std::vector<Vec2i> projected_vertices(clipped_model->vertices.size());
-		for (size_t i = 0; i < clipped_model->vertices.size(); ++i)
-			projected_vertices[i] = project_vertex(clipped_model->vertices[i]);
+		transform_and_clip(instance, model, model_view, _worker_scratch[0], output);
 
-		for (auto& triangle : clipped_model->triangles)
+		for (auto& triangle : output)
+			queue_triangle(triangle);
+	}
+
+	// Transforms, culls and clips a batch of instances spread over the worker pool.
+	// Each worker writes into its own triangle list, and the lists are queued in the order the
+	// instances were given, so the frame comes out as if each had gone through draw_simple_model.
+	void draw_simple_models(const std::vector<const ModelInstance*>& instances)
+	{
+		// Bringing lazy transforms up to date may touch parents the instances share, and picking
+		// levels of detail updates the instances, so neither can be left to the workers. Occluded
+		// instances are left without a level, like ones whose assets haven't loaded.
+		_model_views.resize(instances.size());
+		_instance_lods.resize(instances.size());
+		for (size_t i = 0; i < instances.size(); ++i)
+		{
+			_model_views[i] = &instances[i]->get_model_view(_camera_transform, _camera_id);
+			_instance_lods[i] = select_lod(*instances[i], *_model_views[i]);
+			if (_instance_lods[i] != nullptr && is_occluded(*instances[i], *_instance_lods[i], *_model_views[i]))
+				_instance_lods[i] = nullptr;
+		}
+
+		process_in_parallel(instances.size(), [&](size_t i, GeometryScratch& scratch, std::vector<QueuedTriangle>& output)
+		{
+			transform_and_clip(*instances[i], _instance_lods[i], *_model_views[i], scratch, output);
+		});
+	}
+
+	// Draws a copy of the model for each of the transforms, which take it into world space and
+	// may rotate, translate and scale it uniformly. The copies' bounding spheres are culled all
+	// together in world space, several at a time, and only the copies left get their full camera
+	// transforms, spread over the worker pool like draw_simple_models. Copies have nowhere to keep
+	// the level of detail they were drawn with, so theirs are picked without hysteresis.
+	void draw_instanced(const Model& model, const Mat* transforms, size_t count)
+	{
+		Plane cull_planes[6];
+		Plane clip_planes[6];
+		get_world_planes(_cull_planes, cull_planes);
+		get_world_planes(_clip_planes, clip_planes);
+
+		// Padded to whole SIMD batches
+		auto padded_count = (count + SoaVertices::batch_size - 1) / SoaVertices::batch_size * SoaVertices::batch_size;
+		_sphere_x.assign(padded_count, 0.0f);
+		_sphere_y.assign(padded_count, 0.0f);
+		_sphere_z.assign(padded_count, 0.0f);
+		_sphere_radius.assign(padded_count, 0.0f);
+
+		for (size_t i = 0; i < count; ++i)
 		{
-			//Cull all back facing triandles
-			auto vertex = clipped_model->vertices[triangle.vertex_indices.x];
-			auto normal = compute_triangle_normal(
-				clipped_model->vertices[triangle.vertex_indices.x],
-				clipped_model->vertices[triangle.vertex_indices.y],
-				clipped_model->vertices[triangle.vertex_indices.z]
-			);
-			if (compute_dot_product(vertex, normal) <= 0)
+			auto center = transforms[i].multiply_affine(model.bounding_sphere.center);
+			_sphere_x[i] = center.x;
+			_sphere_y[i] = center.y;
+			_sphere_z[i] = center.z;
+			_sphere_radius[i] = model.bounding_sphere.radius * transforms[i].get_affine_scale();
+		}
+
+		classify_spheres(cull_planes, clip_planes, padded_count);
+
+		_visible_copies.clear();
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (_sphere_classes[i] != SphereClass::outside)
+				_visible_copies.push_back(static_cast<uint32_t>(i));
+		}
+
+		process_in_parallel(_visible_copies.size(), [&](size_t i, GeometryScratch& scratch, std::vector<QueuedTriangle>& output)
+		{
+			auto copy = _visible_copies[i];
+			auto overall_transform = _camera_transform.multiply_affine(transforms[copy]);
+			auto scale = transforms[copy].get_affine_scale();
+			auto center = overall_transform.multiply_affine(model.bounding_sphere.center);
+			auto level = model.get_coarsest_lod(get_projected_radius(center, model.bounding_sphere.radius * scale), _lod_pixel_error);
+			if (level == 0)
 			{
-				continue;
+				transform_and_clip(model, overall_transform, _sphere_classes[copy] == SphereClass::inside, scratch, output);
+				return;
 			}
 
-			draw_triangle_2d_filled(
-				projected_vertices[triangle.vertex_indices.x],
-				projected_vertices[triangle.vertex_indices.y],
-				projected_vertices[triangle.vertex_indices.z],
-				clipped_model->vertices[triangle.vertex_indices.x].z,
-				clipped_model->vertices[triangle.vertex_indices.y].z,
-				clipped_model->vertices[triangle.vertex_indices.z].z,
-				triangle.color);
+			// Simpler levels have bounding spheres of their own, which needn't fit in the full model's
+			auto& lod = model.get_lod(level);
+			auto sphere_class = classify_sphere(_cull_planes, _clip_planes,
+				overall_transform.multiply_affine(lod.bounding_sphere.center), lod.bounding_sphere.radius * scale);
+			if (sphere_class != SphereClass::outside)
+				transform_and_clip(lod, overall_transform, sphere_class == SphereClass::inside, scratch, output);
+		});
+	}
+
+	void draw_instanced(const Model& model, const std::vector<Mat>& transforms)
+	{
+		draw_instanced(model, transforms.data(), transforms.size());
+	}
+
+	// Brings the scene's hierarchy up to date, then draws whatever of it the frustum doesn't
+	// rule out, skipping whole groups of instances at a time
+	void draw_scene(Scene& scene)
+	{
+		Plane world_planes[6];
+		get_world_planes(_cull_planes, world_planes);
+
+		scene.refit();
+		_visible_instances.clear();
+		scene.cull(world_planes, _plane_count, _visible_instances);
+		draw_simple_models(_visible_instances);
+	}
+
+	// Draws everything recorded in the buffer, all in one go like draw_simple_models, but sorted
+	// by the camera space depth of each instance's bounding sphere center rather than in the order
+	// it was recorded in. Sorted afresh each time, so a buffer can be executed again next frame
+	// after the camera or the instances have moved. Ties keep their recorded order.
+	void execute(const CommandBuffer& commands)
+	{
+		_sorted_draws.clear();
+		for (auto& command : commands._commands)
+		{
+			auto& instance = *command.instance;
+			auto& model_view = instance.get_model_view(_camera_transform, _camera_id);
+			auto depth = model_view.multiply_affine(instance.get_bounding_sphere().center).z;
+			_sorted_draws.push_back({ &instance, command.pass, command.pass == CommandBuffer::Pass::blended ? -depth : depth });
 		}
+
+		std::stable_sort(_sorted_draws.begin(), _sorted_draws.end(), [](const SortedDraw& a, const SortedDraw& b)
+		{
+			return a.pass != b.pass ? a.pass < b.pass : a.depth < b.depth;
+		});
+
+		_sorted_instances.clear();
+		for (auto& draw : _sorted_draws)
+			_sorted_instances.push_back(draw.instance);
+		draw_simple_models(_sorted_instances);
 	}
 
 private:
+	// Where a bounding sphere stands against the frustum. Inside means inside every clip plane,
+	// so none of the model's triangles need clipping.
+	enum class SphereClass : uint8_t { outside, intersecting, inside };
+
 	Vec3f _camera_position;
 	Mat   _camera_orientation;
 	Mat   _camera_transform;
-	std::vector<float> _depth_buffer{};
+	//Tells instances' cached model-view matrices which camera transform they were made with
+	uint64_t _camera_id = 0;
+	RasterizerEngine _rasterizer_engine = RasterizerEngine::scanline;
+	float _lod_pixel_error = 1;
+
+	//Instances and triangles entirely outside any of these are dropped
+	Plane  _cull_planes[6];
+	//Triangles crossing any of these are cut at it. Only the sides differ from the cull planes,
+	//and only when the guard band is on.
+	Plane  _clip_planes[6];
+	size_t _plane_count = 5;
+	bool   _guard_band_clipping = false;
+	float  _far_plane_distance = 0;
+
+	//Colors and depths are drawn into tiled buffers, and only the colors are copied out when presenting.
+	//Only the depth buffer for the format in use has anything in it.
+	TiledLayout _layout;
+	TiledLayout::Buffer<uint32_t> _color_buffer{};
+	std::tuple<TiledLayout::Buffer<float>, TiledLayout::Buffer<uint32_t>, TiledLayout::Buffer<uint16_t>> _depth_buffers{};
+	DepthFormat _depth_format = DepthFormat::float32;
+	HierarchicalZ _hierarchical_z;
+
+	//Last frame's depths, and which camera they have been moved over to. Instances they hid this
+	//frame are tested again against this frame's own depths at present, and those that turn out to
+	//have been hidden by mistake skip the test next frame.
+	OcclusionBuffer _occlusion_buffer;
+	bool _occlusion_culling = false;
+	uint64_t _occlusion_camera_id = 0;
+	std::vector<OccludedInstance> _occluded_instances{};
+	//Sorted, for searching
+	std::vector<const ModelInstance*> _occlusion_retests{};
+
+	//The frame each tile was last cleared in. Tiles from an older frame hold stale pixels and are
+	//cleared the first time anything draws into them.
+	std::vector<uint32_t> _tile_frames{};
+	uint32_t _frame = 1;
+
+	TileGrid _tiles;
+	std::unique_ptr<WorkerPool> _workers;
+	std::vector<QueuedTriangle> _frame_triangles{};
+	std::vector<std::vector<QueuedTriangle>> _worker_triangles{};
+	std::vector<GeometryScratch> _worker_scratch{};
+	std::vector<InstanceTriangles> _instance_triangles{};
+	std::vector<const ModelInstance*> _visible_instances{};
+	std::vector<const Mat*> _model_views{};
+	std::vector<const Model*> _instance_lods{};
+
+	//draw_instanced's bounding spheres in world space, one array per coordinate, and the copies
+	//left after culling them
+	SoaVertices::Array       _sphere_x{};
+	SoaVertices::Array       _sphere_y{};
+	SoaVertices::Array       _sphere_z{};
+	SoaVertices::Array       _sphere_radius{};
+	std::vector<SphereClass> _sphere_classes{};
+	std::vector<uint32_t>    _visible_copies{};
+
+	//execute's draws, in the order they go in
+	std::vector<SortedDraw>           _sorted_draws{};
+	std::vector<const ModelInstance*> _sorted_instances{};
+
+	// Runs process(i, scratch, output) for i in [0, count) on the worker pool, then queues what
+	// each one put in its output in order of i, so the result doesn't depend on the thread count
+	template <typename Process>
+	void process_in_parallel(size_t count, Process&& process)
+	{
+		for (auto& output : _worker_triangles)
+			output.clear();
+		_instance_triangles.resize(count);
+
+		_workers->parallel_for(count, [&](size_t i, size_t worker)
+		{
+			auto& output = _worker_triangles[worker];
+			auto first = output.size();
+			process(i, _worker_scratch[worker], output);
+			_instance_triangles[i] = { worker, first, output.size() };
+		});
+
+		for (auto& range : _instance_triangles)
+		for (auto i = range.first; i < range.last; ++i)
+			queue_triangle(_worker_triangles[range.worker][i]);
+	}
+
+	// Calls f with the class for the depth format in use, for f to be templated on
+	template <typename F>
+	void with_depth_format(F&& f)
+	{
+		switch (_depth_format)
+		{
+		case DepthFormat::float32: f(Float32Depth{}); break;
+		case DepthFormat::unorm24: f(Unorm24Depth{}); break;
+		case DepthFormat::unorm16: f(Unorm16Depth{}); break;
+		}
+	}
+
+	template <typename Depth>
+	TiledLayout::Buffer<typename Depth::Value>& get_depth_buffer()
+	{
+		return std::get<TiledLayout::Buffer<typename Depth::Value>>(_depth_buffers);
+	}
+
+	void update_clipping_planes()
+	{
+		for (size_t i = 0; i < 5; ++i)
+		{
+			_cull_planes[i] = clipping_planes[i];
+			_clip_planes[i] = (i == 0 || !_guard_band_clipping) ? clipping_planes[i] : guard_band_planes[i - 1];
+		}
+
+		_plane_count = 5;
+		if (_far_plane_distance > 0)
+		{
+			_cull_planes[5] = { { 0, 0, -1 }, _far_plane_distance };
+			_clip_planes[5] = _cull_planes[5];
+			_plane_count = 6;
+		}
+	}
+
+	// Camera space planes moved out into world space. For a camera transform p' = R p + t, the
+	// plane n.p' + d >= 0 is (R^T n).p + (n.t + d) >= 0, and R being a rotation keeps n unit length.
+	void get_world_planes(const Plane* camera_planes, Plane* planes) const
+	{
+		auto& m = _camera_transform.elements;
+		for (size_t i = 0; i < _plane_count; ++i)
+		{
+			auto& n = camera_planes[i].normal;
+			planes[i].normal = {
+				m[0] * n.x + m[4] * n.y + m[8] * n.z,
+				m[1] * n.x + m[5] * n.y + m[9] * n.z,
+				m[2] * n.x + m[6] * n.y + m[10] * n.z };
+			planes[i].distance = n.x * m[3] + n.y * m[7] + n.z * m[11] + camera_planes[i].distance;
+		}
+	}
 
 	void compose_camera_transform()
 	{
 		_camera_transform = _camera_orientation.transpose()
-			* Mat::get_translation_matrix(-_camera_position);
+			.multiply_affine(Mat::get_translation_matrix(-_camera_position));
+
+		// Unique across canvases, so an instance drawn by several never mixes up their cameras
+		static std::atomic<uint64_t> next_camera_id{ 1 };
+		_camera_id = next_camera_id++;
 	}
 
-	std::unique_ptr<Model> clip_model(const ModelInstance& instance, const Mat& transform) const
+	// Where the camera is in the model's own space. The transform is a rotation and a uniform scale,
+	// A, then a translation t, so A's inverse is its transpose over the scale squared, and the
+	// camera's origin goes back to -A^T t / s^2.
+	static Vec3f get_model_space_eye(const Mat& transform)
 	{
-		//----------------------------------------------------------------------------------------
-		// Phase 1: Reject the model if it is clipped entirely
-		//----------------------------------------------------------------------------------------
+		auto& m = transform.elements;
+		auto scale_squared = m[0] * m[0] + m[4] * m[4] + m[8] * m[8];
+		return {
+			-(m[0] * m[3] + m[4] * m[7] + m[8] * m[11]) / scale_squared,
+			-(m[1] * m[3] + m[5] * m[7] + m[9] * m[11]) / scale_squared,
+			-(m[2] * m[3] + m[6] * m[7] + m[10] * m[11]) / scale_squared };
+	}
+
+	// Whether occlusion culling is on and the occlusion buffer hides the instance, drawn as the given
+	// model. Hidden instances are kept for present to test again.
+	bool is_occluded(const ModelInstance& instance, const Model& model, const Mat& model_view)
+	{
+		if (!_occlusion_culling
+			|| std::binary_search(_occlusion_retests.begin(), _occlusion_retests.end(), &instance))
+			return false;
+
+		if (_occlusion_camera_id != _camera_id)
+		{
+			_occlusion_buffer.reproject(_camera_transform);
+			_occlusion_camera_id = _camera_id;
+		}
+
+		auto center = model_view.multiply_affine(model.bounding_sphere.center);
+		auto radius = model.bounding_sphere.radius * instance.get_world_scale();
+		if (!_occlusion_buffer.is_hidden(center, radius))
+			return false;
+
+		_occluded_instances.push_back({ &instance, center, radius });
+		return true;
+	}
+
+	// Hands the frame just drawn to the occlusion buffer, then tests whatever it hid this frame
+	// against it. Those that would have shown after all are drawn next frame without a test.
+	void capture_occlusion_buffer()
+	{
+		static_assert(OcclusionBuffer::cell_size == TiledLayout::block_size, "Cells are read from the depth pyramid's blocks");
+
+		with_depth_format([this](auto depth)
+		{
+			using Depth = decltype(depth);
+			auto& buffer = get_depth_buffer<Depth>();
+			_workers->parallel_for(_layout.get_tile_count(), [&](size_t tile, size_t)
+			{
+				if (_tile_frames[tile] == _frame)
+					_hierarchical_z.update_tile<Depth>(tile, buffer.data());
+			});
+
+			// The camera transform's inverse, R^T being the inverse of the rotation R
+			auto camera_to_world = Mat::get_translation_matrix(_camera_position).multiply_affine(_camera_orientation);
+			_occlusion_buffer.capture(camera_to_world, [&](int column, int row)
+			{
+				auto x = column * OcclusionBuffer::cell_size;
+				auto y = row * OcclusionBuffer::cell_size;
+				if (_tile_frames[_layout.get_tile(x, y)] != _frame)
+					return 0.0f;
+				return Depth::decode(_hierarchical_z.get_block_farthest(_layout.get_block_row(x, y) / TiledLayout::block_pixels));
+			});
+		});
+		_occlusion_camera_id = _camera_id;
+
+		_occlusion_retests.clear();
+		for (auto& occluded : _occluded_instances)
+		{
+			if (!_occlusion_buffer.is_hidden(occluded.center, occluded.radius))
+				_occlusion_retests.push_back(occluded.instance);
+		}
+		std::sort(_occlusion_retests.begin(), _occlusion_retests.end());
+		_occluded_instances.clear();
+	}
+
+	// The level of detail an instance's size on screen calls for, nullptr if its asset hasn't loaded
+	const Model* select_lod(const ModelInstance& instance, const Mat& model_view) const
+	{
+		auto model = instance.get_model();
+		if (model == nullptr)
+			return nullptr;
+
+		auto center = model_view.multiply_affine(model->bounding_sphere.center);
+		auto radius = model->bounding_sphere.radius * instance.get_world_scale();
+		return instance.select_lod(get_projected_radius(center, radius), _lod_pixel_error);
+	}
+
+	// Roughly how many pixels a camera space sphere's radius spans on screen. Without limit once
+	// the sphere takes in the camera's plane.
+	float get_projected_radius(const Vec3f& center, float radius) const
+	{
+		if (center.z <= radius)
+			return std::numeric_limits<float>::max();
+
+		auto pixels_per_unit = static_cast<float>(std::max(_width, _height)) / viewport_size;
+		return radius * projection_plane_z / center.z * pixels_per_unit;
+	}
+
+	// Everything up to rasterization for one instance, given its model-view matrix and the level
+	// of detail picked for it. Only reads shared state, so workers can run it for different
+	// instances at once.
+	void transform_and_clip(const ModelInstance& instance, const Model* model, const Mat& overall_transform,
+		GeometryScratch& scratch, std::vector<QueuedTriangle>& output) const
+	{
+		// Nothing to draw until the instance's asset has loaded
+		if (model == nullptr)
+			return;
 
 		// Get the transformed center and radius of the model's bounding sphere
-		auto transformed_center = transform * instance.model.bounding_sphere.center;
-		auto transformed_radius = instance.model.bounding_sphere.radius * instance.get_scale();
+		auto sphere_class = classify_sphere(_cull_planes, _clip_planes,
+			overall_transform.multiply_affine(model->bounding_sphere.center),
+			model->bounding_sphere.radius * instance.get_world_scale());
 
 		// Discard instance if it is entirely outside of the viewing frustum
-		for (auto& clipping_plane : clipping_planes)
+		if (sphere_class == SphereClass::outside)
+			return;
+
+		transform_and_clip(*model, overall_transform, sphere_class == SphereClass::inside, scratch, output);
+	}
+
+	// The rest, for a model already in camera space whose bounding sphere is at least partly in the frustum
+	void transform_and_clip(const Model& model, const Mat& overall_transform, bool fully_inside,
+		GeometryScratch& scratch, std::vector<QueuedTriangle>& output) const
+	{
+		auto& vertices = scratch.vertices;
+		auto model_vertex_count = model.vertices.size();
+
+		// The model's own vertices were projected along with the transform, only the ones the
+		// clipper made still need it
+		auto project = [&](int i)
+		{
+			return static_cast<size_t>(i) < model_vertex_count
+				? Vec2f{ scratch.projected_x[i], scratch.projected_y[i] }
+				: project_vertex(vertices[i]);
+		};
+
+		clip_model(model, overall_transform, fully_inside, scratch, [&](const Vec3i& indices, const Color& color)
+		{
+			auto v0 = vertices[indices.x];
+			auto v1 = vertices[indices.y];
+			auto v2 = vertices[indices.z];
+
+			output.push_back(make_queued_triangle(
+				project(indices.x),
+				project(indices.y),
+				project(indices.z),
+				v0.z,
+				v1.z,
+				v2.z,
+				color));
+		});
+	}
+
+	// Against cull and clip planes in the same space as the sphere, with unit length normals
+	SphereClass classify_sphere(const Plane* cull_planes, const Plane* clip_planes, const Vec3f& center, float radius) const
+	{
+		auto fully_inside = true;
+		for (size_t p = 0; p < _plane_count; ++p)
 		{
-			auto distance = compute_dot_product(clipping_plane.normal, transformed_center)
+			auto& clipping_plane = cull_planes[p];
+			auto distance = compute_dot_product(clipping_plane.normal, center)
 				+ clipping_plane.distance;
-			if (distance < -transformed_radius)//Entire sphere is outside of the plane
+			if (distance < -radius)//Entire sphere is outside of the plane
+			{
+
+				return SphereClass::outside;
+			}
+
+			// With the whole sphere in front of every clip plane, no triangle can cross one
+			auto& clip_plane = clip_planes[p];
+			auto clip_distance = compute_dot_product(clip_plane.normal, center)
+				+ clip_plane.distance;
+			fully_inside = fully_inside && clip_distance > radius;
+		}
+
+		return fully_inside ? SphereClass::inside : SphereClass::intersecting;
+	}
+
+	// classify_sphere for the first count of draw_instanced's spheres, count being a multiple of 4,
+	// testing four spheres against each plane at once
+	void classify_spheres(const Plane* cull_planes, const Plane* clip_planes, size_t count)
+	{
+		_sphere_classes.resize(count);
+
+#if RASTERIZER_HAS_SSE2
+		for (size_t i = 0; i < count; i += 4)
+		{
+			auto x = _mm_load_ps(_sphere_x.data() + i);
+			auto y = _mm_load_ps(_sphere_y.data() + i);
+			auto z = _mm_load_ps(_sphere_z.data() + i);
+			auto radius = _mm_load_ps(_sphere_radius.data() + i);
+			auto negative_radius = _mm_sub_ps(_mm_setzero_ps(), radius);
+
+			auto outside = _mm_setzero_ps();
+			auto inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (size_t p = 0; p < _plane_count; ++p)
 			{
+				auto& cull = cull_planes[p];
+				auto distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_set1_ps(cull.normal.x), x),
+					_mm_mul_ps(_mm_set1_ps(cull.normal.y), y)),
+					_mm_mul_ps(_mm_set1_ps(cull.normal.z), z)),
+					_mm_set1_ps(cull.distance));
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negative_radius));
+
+				auto& clip = clip_planes[p];
+				auto clip_distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_set1_ps(clip.normal.x), x),
+					_mm_mul_ps(_mm_set1_ps(clip.normal.y), y)),
+					_mm_mul_ps(_mm_set1_ps(clip.normal.z), z)),
+					_mm_set1_ps(clip.distance));
+				inside = _mm_and_ps(inside, _mm_cmpgt_ps(clip_distance, radius));
+			}
 
-				return nullptr;
+			auto outside_bits = _mm_movemask_ps(outside);
+			auto inside_bits = _mm_movemask_ps(inside);
+			for (auto lane = 0; lane < 4; ++lane)
+			{
+				_sphere_classes[i + lane] = (outside_bits & (1 << lane)) != 0 ? SphereClass::outside
+					: (inside_bits & (1 << lane)) != 0 ? SphereClass::inside
+					: SphereClass::intersecting;
 			}
 		}
+#else
+		for (size_t i = 0; i < count; ++i)
+			_sphere_classes[i] = classify_sphere(cull_planes, clip_planes, { _sphere_x[i], _sphere_y[i], _sphere_z[i] }, _sphere_radius[i]);
+#endif
+	}
+
+	// Sends every visible piece of the model's triangles to emit(vertex_indices, color), with the
+	// indices pointing into scratch.vertices. The model's bounding sphere must be at least partly
+	// in the frustum, and fully_inside says it is entirely inside every clip plane.
+	template <typename Emit>
+	void clip_model(const Model& model, const Mat& transform, bool fully_inside,
+		GeometryScratch& scratch, Emit&& emit) const
+	{
 		//----------------------------------------------------------------------------------------
-		// Phase 2: Clip individual triangls in the model
+		// Phase 1: Cull back facing triangles in model space, before anything is transformed
 		//----------------------------------------------------------------------------------------
 
-		// Transform vertices
-		std::vector<Vec3f> verticies(instance.model.vertices.size());
-		for (size_t i = 0; i < instance.model.vertices.size(); ++i)
+		auto eye = get_model_space_eye(transform);
+		auto& front_triangles = scratch.front_triangles;
+		front_triangles.clear();
+
+		// Which batches of vertices the front facing triangles use. MeshOptimizer numbers vertices
+		// in the order triangles use them, so a meshlet's tend to fill whole batches.
+		auto batched_count = model.soa_vertices.size();
+		auto& used_batches = scratch.used_batches;
+		used_batches.assign(batched_count / SoaVertices::batch_size, 0);
+
+		for (auto& meshlet : model.meshlets)
 		{
-			auto tv = transform * instance.model.vertices[i];
-			verticies[i] = { tv.x, tv.y, tv.z };
+			if (meshlet.is_back_facing(eye))
+				continue;
+
+			for (auto t = meshlet.first_triangle; t < meshlet.first_triangle + meshlet.triangle_count; ++t)
+			{
+				auto& plane = model.face_planes[t];
+				if (compute_dot_product(plane.normal, eye) + plane.distance <= 0)
+					continue;
+
+				front_triangles.push_back(t);
+				auto& indices = model.triangles[t].vertex_indices;
+				used_batches[indices.x / SoaVertices::batch_size] = 1;
+				used_batches[indices.y / SoaVertices::batch_size] = 1;
+				used_batches[indices.z / SoaVertices::batch_size] = 1;
+			}
 		}
-		// Clip each of the triangles (with transformed vertices) against each successive plane
 
-		// Step 1.) Copy model triangles to vectors we will call "unclipped"
-		std::vector<Triangle> unclipped_triangles{ instance.model.triangles };
+		if (front_triangles.empty())
+			return;
 
-		// Step 2.) Go through each of the clipping planes
-		for (auto& clipping_plane : clipping_planes)
-		{
-			// Step 3.) Create empty vectors to hold the triangles after they are clipped
-			std::vector<Triangle> clipped_traingles;
+		//----------------------------------------------------------------------------------------
+		// Phase 2: Transform vertices and find out which planes each one is outside of
+		//----------------------------------------------------------------------------------------
 
-			// Step 4.) Go through each of the triangles (for the current clipping plane)
-			for (auto& unclipped_triangle : unclipped_triangles)
+		auto& verticies = scratch.vertices;
+		auto& outcodes = scratch.outcodes;
+
+		// A whole number of batches, with the clipper's vertices going after the padding. Only
+		// used batches are transformed, each run of them in one go, and the rest are left as
+		// they were since nothing reads them.
+		verticies.resize(batched_count);
+		scratch.projected_x.resize(batched_count);
+		scratch.projected_y.resize(batched_count);
+
+		for (size_t batch = 0; batch < used_batches.size();)
+		{
+			if (used_batches[batch] == 0)
 			{
-				// Step 5.) Add the clipped triangles to the clipped triangle vectors
-				clip_triangle(clipping_plane, unclipped_triangle, verticies, clipped_traingles);
+				++batch;
+				continue;
 			}
 
-			// Step 6.) The vectors now have triangles clipped relative to the current clipping plane.
-			//          Copy them to the unclipped vectors because they have not yet been clipped relative
-			//            to the next clipping plane.
+			auto run_end = batch + 1;
+			while (run_end < used_batches.size() && used_batches[run_end] != 0)
+				++run_end;
 
-			unclipped_triangles = std::vector<Triangle>{ clipped_traingles };
+			VertexTransform::transform_and_project(transform, model.soa_vertices,
+				batch * SoaVertices::batch_size, (run_end - batch) * SoaVertices::batch_size,
+				verticies, scratch.projected_x.data(), scratch.projected_y.data(), projection_plane_z,
+				static_cast<float>(_width) / viewport_size, static_cast<float>(_height) / viewport_size);
+			batch = run_end;
+		}
 
+		if (fully_inside)
+		{
+			// Straight to projection: no outcodes and no clipper
+			for (auto t : front_triangles)
+				emit(model.triangles[t].vertex_indices, model.triangles[t].color);
+
+			return;
 		}
 
-		// Step 7.) There was not a next clipping plane, so the triangles that are in the "unclipped" vectors
-		//            are actually fully clipped.  So, pass back a new model made up of the clipped triangles.
-		return std::make_unique<Model>(Model{ verticies, unclipped_triangles });
-	}
+		outcodes.resize(model.vertices.size());
+		for (size_t batch = 0; batch < used_batches.size(); ++batch)
+		{
+			if (used_batches[batch] == 0)
+				continue;
 
-	void clip_triangle(const Plane& plane, const Triangle& triangle,
-		std::vector<Vec3f>& vertices, std::vector<Triangle>& triangles) const
-	{
-		auto dist_from_plane_v1 = compute_dot_product(plane.normal,
-			vertices[triangle.vertex_indices.x]) + plane.distance;
-		auto dist_from_plane_v2 = compute_dot_product(plane.normal,
-			vertices[triangle.vertex_indices.y]) + plane.distance;
-		auto dist_from_plane_v3 = compute_dot_product(plane.normal,
-			vertices[triangle.vertex_indices.z]) + plane.distance;
+			auto end = std::min((batch + 1) * SoaVertices::batch_size, model.vertices.size());
+			for (auto i = batch * SoaVertices::batch_size; i < end; ++i)
+				outcodes[i] = compute_outcode(verticies[i]);
+		}
 
-		auto count_in_plane = (dist_from_plane_v1 > 0 ? 1 : 0)
-			+ (dist_from_plane_v2 > 0 ? 1 : 0)
-			+ (dist_from_plane_v3 > 0 ? 1 : 0);
+		//----------------------------------------------------------------------------------------
+		// Phase 3: Clip individual triangls in the model, in a single pass
+		//----------------------------------------------------------------------------------------
 
-		// The triangle is fully in front of the plane.
-		if (count_in_plane == 3)
+		for (auto t : front_triangles)
 		{
-			triangles.push_back(triangle);
-		}
-		else if (count_in_plane == 1)
-		{   // The triangle has one vertex in. Add one clipped triangle.
-
-			// Set A to the vertex inside the frustrum and idx_a to it's index
-			// Set B and C to the other two vertices
-			auto a = vertices[triangle.vertex_indices.x];
-			auto b = vertices[triangle.vertex_indices.y];
-			auto c = vertices[triangle.vertex_indices.z];
-			auto idx_a = triangle.vertex_indices.x;
-			if (dist_from_plane_v2 > 0)
-			{
-				a = vertices[triangle.vertex_indices.y];
-				b = vertices[triangle.vertex_indices.z];
-				c = vertices[triangle.vertex_indices.x];
-				idx_a = triangle.vertex_indices.y;
-			}
-			else if (dist_from_plane_v3 > 0)
+			auto& triangle = model.triangles[t];
+			auto outcode_a = outcodes[triangle.vertex_indices.x];
+			auto outcode_b = outcodes[triangle.vertex_indices.y];
+			auto outcode_c = outcodes[triangle.vertex_indices.z];
+
+			// All three vertices are outside of the same plane, so nothing of it is left
+			if ((outcode_a & outcode_b & outcode_c & cull_outcode_bits) != 0)
+				continue;
+
+			// No vertex is outside of a plane that clips, so it goes through untouched
+			auto crossed_planes = static_cast<uint8_t>((outcode_a | outcode_b | outcode_c) >> 8);
+			if (crossed_planes == 0)
 			{
-				a = vertices[triangle.vertex_indices.z];
-				b = vertices[triangle.vertex_indices.x];
-				c = vertices[triangle.vertex_indices.y];
-				idx_a = triangle.vertex_indices.z;
+				emit(triangle.vertex_indices, triangle.color);
+				continue;
 			}
 
-			// Create new vertices where AB and AC intersect the clipping plane
-			auto new_b = compute_intersection(a, b, plane);
-			auto new_c = compute_intersection(a, c, plane);
+			clip_triangle(triangle, crossed_planes, verticies, emit);
+		}
+	}
 
-			// Add the new vertices to the vertices list and get their indexes
-			vertices.push_back(new_b);
-			vertices.push_back(new_c);
-			auto idx_b = static_cast<int>(vertices.size()) - 2;
-			auto idx_c = static_cast<int>(vertices.size()) - 1;
+	// Bit i is set when the vertex is not in front of cull plane i, and bit 8 + i when it is
+	// not in front of clip plane i
+	static constexpr uint16_t cull_outcode_bits = 0x00FF;
 
-			// Add the new triangle made up of A, the new B, and the new C (and its color)
-			triangles.push_back({ { idx_a, idx_b, idx_c }, triangle.color });
+	uint16_t compute_outcode(const Vec3f& vertex) const
+	{
+		uint16_t outcode = 0;
+		for (size_t i = 0; i < _plane_count; ++i)
+		{
+			if (compute_dot_product(_cull_planes[i].normal, vertex) + _cull_planes[i].distance <= 0)
+				outcode |= static_cast<uint16_t>(1 << i);
+			if (compute_dot_product(_clip_planes[i].normal, vertex) + _clip_planes[i].distance <= 0)
+				outcode |= static_cast<uint16_t>(1 << (i + 8));
 		}
-		else if (count_in_plane == 2)
-		{   // The triangle has two vertices in. Add two clipped triangles.
-
-			// Set C to the vertex outside the frustrum
-			// Set A and B to the other two vertices and idx_a and idx_b to their indices
-			auto a = vertices[triangle.vertex_indices.x];
-			auto b = vertices[triangle.vertex_indices.y];
-			auto c = vertices[triangle.vertex_indices.z];
-			auto idx_a = triangle.vertex_indices.x;
-			auto idx_b = triangle.vertex_indices.y;
-			if (dist_from_plane_v1 <= 0)
-			{
-				a = vertices[triangle.vertex_indices.y];
-				b = vertices[triangle.vertex_indices.z];
-				c = vertices[triangle.vertex_indices.x];
-				idx_a = triangle.vertex_indices.y;
-				idx_b = triangle.vertex_indices.z;
-			}
-			else if (dist_from_plane_v2 <= 0)
-			{
-				a = vertices[triangle.vertex_indices.z];
-				b = vertices[triangle.vertex_indices.x];
-				c = vertices[triangle.vertex_indices.y];
-				idx_a = triangle.vertex_indices.z;
-				idx_b = triangle.vertex_indices.x;
-			}
+		return outcode;
+	}
 
-			// Create new vertices where AC and BC intersect the clipping plane
-			auto new_a = compute_intersection(a, c, plane);
-			auto new_b = compute_intersection(b, c, plane);
+	// Sutherland-Hodgman: clips the triangle as a polygon against only the planes it crosses,
+	// appending the new corners to vertices, then emits what is left as a fan.
+	template <typename Emit>
+	void clip_triangle(const Triangle& triangle, uint8_t planes, SoaVertices& vertices, Emit&& emit) const
+	{
+		// Clipping a convex polygon against a plane adds at most one corner, so 3 + 6 is plenty
+		int polygon[9] = { triangle.vertex_indices.x, triangle.vertex_indices.y, triangle.vertex_indices.z };
+		int clipped[9];
+		auto corner_count = 3;
+
+		for (size_t p = 0; p < _plane_count; ++p)
+		{
+			if ((planes & (1 << p)) == 0)
+				continue;
 
-			// Add the new vertices to the vertices list and get their indexes
-			vertices.push_back(new_a);
-			vertices.push_back(new_b);
-			auto idx_new_a = static_cast<int>(vertices.size()) - 2;
-			auto idx_new_b = static_cast<int>(vertices.size()) - 1;
+			auto& plane = _clip_planes[p];
+			auto clipped_count = 0;
+			for (auto i = 0; i < corner_count; ++i)
+			{
+				auto current = polygon[i];
+				auto next = polygon[(i + 1) % corner_count];
+				auto current_in = compute_dot_product(plane.normal, vertices[current]) + plane.distance > 0;
+				auto next_in = compute_dot_product(plane.normal, vertices[next]) + plane.distance > 0;
+
+				if (current_in)
+					clipped[clipped_count++] = current;
+
+				if (current_in != next_in)
+				{
+					// Always go from the inside corner, so triangles sharing this edge get the same point
+					auto intersection = current_in
+						? compute_intersection(vertices[current], vertices[next], plane)
+						: compute_intersection(vertices[next], vertices[current], plane);
+					vertices.push_back(intersection);
+					clipped[clipped_count++] = static_cast<int>(vertices.size()) - 1;
+				}
+			}
 
-			// Add the new triangle made up of A, B and the new A (and its color)
-			triangles.push_back({ { idx_a, idx_b, idx_new_a }, triangle.color });
+			if (clipped_count < 3)
+				return;
 
-			// Add the new triangle made up of the new A, B and the new B (and its color)
-			triangles.push_back({ { idx_new_a, idx_b, idx_new_b }, triangle.color });
+			std::copy(clipped, clipped + clipped_count, polygon);
+			corner_count = clipped_count;
 		}
+
+		for (auto i = 1; i + 1 < corner_count; ++i)
+			emit(Vec3i{ polygon[0], polygon[i], polygon[i + 1] }, triangle.color);
 	}
 
-	void draw_triangle_2d(Vec2i pt1, Vec2i pt2, Vec2i pt3, const Color& color) const
+	void draw_triangle_2d(Vec2i pt1, Vec2i pt2, Vec2i pt3, const Color& color)
 	{
 		draw_line_2d(pt1, pt2, color);
 		draw_line_2d(pt2, pt3, color);
 		draw_line_2d(pt3, pt1, color);
 	}
 
-	void draw_triangle_2d_filled(Vec2i pt1, Vec2i pt2, Vec2i pt3, 
-		float pt1z, float pt2z, float pt3z, const Color& color) 
+	static QueuedTriangle make_queued_triangle(const Vec2f& pt1, const Vec2f& pt2, const Vec2f& pt3,
+		float pt1z, float pt2z, float pt3z, const Color& color)
+	{
+		return { { pt1, pt2, pt3 }, { pt1z, pt2z, pt3z }, color.to_argb() };
+	}
+
+	// Queues a projected triangle and adds it to the bins of the tiles it may touch.
+	// It is rasterized when the frame is flushed.
+	void queue_triangle(const QueuedTriangle& triangle)
+	{
+		auto s1 = canvas_to_screen(triangle.points[0]);
+		auto s2 = canvas_to_screen(triangle.points[1]);
+		auto s3 = canvas_to_screen(triangle.points[2]);
+
+		// Pixels either engine can touch lie between the floor and the ceiling of the corners,
+		// clamped first so far away points can't overflow the int conversion
+		auto w = static_cast<float>(_width);
+		auto h = static_cast<float>(_height);
+		auto min_x = static_cast<int>(std::floor(std::max(-1.0f, std::min({ s1.x, s2.x, s3.x }))));
+		auto min_y = static_cast<int>(std::floor(std::max(-1.0f, std::min({ s1.y, s2.y, s3.y }))));
+		auto max_x = static_cast<int>(std::ceil(std::min(w, std::max({ s1.x, s2.x, s3.x }))));
+		auto max_y = static_cast<int>(std::ceil(std::min(h, std::max({ s1.y, s2.y, s3.y }))));
+
+		_tiles.bin(static_cast<uint32_t>(_frame_triangles.size()), min_x, min_y, max_x, max_y);
+		_frame_triangles.push_back(triangle);
+	}
+
+	// Each tile only writes its own pixels, so workers never need to lock anything
+	void rasterize_tile(size_t tile)
+	{
+		auto& bin = _tiles.get_bin(tile);
+		if (bin.empty())
+			return;
+
+		prepare_tile(tile);
+		with_depth_format([&](auto depth)
+		{
+			using Depth = decltype(depth);
+			auto target = _tiles.get_tile_target(tile, get_screen_target<Depth>());
+			for (auto index : bin)
+			{
+				// Triangles behind everything in the tile are dropped before their blocks are even walked
+				auto& triangle = _frame_triangles[index];
+				auto nearest = 1.0f / std::min({ triangle.z[0], triangle.z[1], triangle.z[2] });
+				if (static_cast<float>(Depth::encode(nearest)) < _hierarchical_z.get_tile_farthest(tile))
+					continue;
+
+				draw_triangle_filled(target, triangle);
+				_hierarchical_z.finish_triangle(tile);
+			}
+		});
+	}
+
+	// Clears the tile's colors and depths if this frame hasn't yet. A tile is only ever prepared by
+	// the worker rasterizing it, or by put_pixel outside of a flush.
+	void prepare_tile(size_t tile)
+	{
+		if (_tile_frames[tile] == _frame)
+			return;
+
+		auto first = tile * TiledLayout::tile_pixels;
+		std::fill_n(_color_buffer.begin() + first, TiledLayout::tile_pixels, _clear_color);
+		with_depth_format([&](auto depth)
+		{
+			auto& buffer = get_depth_buffer<decltype(depth)>();
+			std::fill_n(buffer.begin() + first, TiledLayout::tile_pixels, typename decltype(depth)::Value{});
+		});
+		_hierarchical_z.clear_tile(tile);
+
+		_tile_frames[tile] = _frame;
+	}
+
+	template <typename Depth>
+	RasterTarget<Depth> get_screen_target()
+	{
+		RasterTarget<Depth> target{};
+		target.pixels = _color_buffer.data();
+		target.depth = get_depth_buffer<Depth>().data();
+		target.layout = &_layout;
+		target.hierarchical_z = &_hierarchical_z;
+		target.min_x = 0;
+		target.min_y = 0;
+		target.max_x = static_cast<int>(_width) - 1;
+		target.max_y = static_cast<int>(_height) - 1;
+		return target;
+	}
+
+	template <typename Depth>
+	void draw_triangle_filled(const RasterTarget<Depth>& target, const QueuedTriangle& triangle)
+	{
+		auto& pts = triangle.points;
+		auto& zs = triangle.z;
+
+		if (_rasterizer_engine == RasterizerEngine::half_space)
+		{
+			HalfSpaceRasterizer::draw_triangle(target,
+				canvas_to_screen(pts[0]), canvas_to_screen(pts[1]), canvas_to_screen(pts[2]),
+				1.0f / zs[0], 1.0f / zs[1], 1.0f / zs[2], triangle.color);
+			return;
+		}
+
+		draw_triangle_2d_filled(target, snap_to_pixel(pts[0]), snap_to_pixel(pts[1]), snap_to_pixel(pts[2]),
+			zs[0], zs[1], zs[2], triangle.color);
+	}
+
+	template <typename Depth>
+	void draw_triangle_2d_filled(const RasterTarget<Depth>& target, Vec2i pt1, Vec2i pt2, Vec2i pt3, 
+		float pt1z, float pt2z, float pt3z, uint32_t color) 
 	{
 		// Sort the points from bottom to top.
 		if (pt2.y < pt1.y)
@@ -294,68 +1123,144 @@ private:
 			std::swap(pt2z, pt3z);
 		}
 
-
-		// Interpolate X coordinates from left to right for each y coordinate
-		auto x_coords_for_each_y = interpolate_between_triangle_edges(
-			pt1.y, static_cast<float>(pt1.x),
-			pt2.y, static_cast<float>(pt2.x),
-			pt3.y, static_cast<float>(pt3.x));
-
-		// Interpolate inverse Z coordinates from left to right for each Y coordinate
-		auto inv_z_coords_for_each_y = interpolate_between_triangle_edges(
-			pt1.y, 1.0f / pt1z,
-			pt2.y, 1.0f / pt2z,
-			pt3.y, 1.0f / pt3z);
-
-		// Draw horizontal segments
-		for (auto y = pt1.y; y <= pt3.y; ++y)
+		// Inverse Z is what changes linearly across the screen
+		auto inv_z1 = 1.0f / pt1z;
+		auto inv_z2 = 1.0f / pt2z;
+		auto inv_z3 = 1.0f / pt3z;
+		auto nearest = static_cast<float>(Depth::encode(std::max({ inv_z1, inv_z2, inv_z3 })));
+		auto test_hidden = HierarchicalZ::is_worth_testing(
+			std::max({ pt1.x, pt2.x, pt3.x }) - std::min({ pt1.x, pt2.x, pt3.x }) + 1, pt3.y - pt1.y + 1);
+
+		// Per-row steps along the long edge (1 to 3)
+		auto long_dx = compute_step(pt1.y, static_cast<float>(pt1.x), pt3.y, static_cast<float>(pt3.x));
+		auto long_dz = compute_step(pt1.y, inv_z1, pt3.y, inv_z3);
+
+		// Per-row steps along the lower short edge (1 to 2), swapped for the upper one (2 to 3) at pt2
+		auto short_dx = compute_step(pt1.y, static_cast<float>(pt1.x), pt2.y, static_cast<float>(pt2.x));
+		auto short_dz = compute_step(pt1.y, inv_z1, pt2.y, inv_z2);
+
+		// The short edges are on the left if the middle point is left of the long edge
+		auto long_x_at_pt2 = static_cast<float>(pt1.x) + static_cast<float>(pt2.y - pt1.y) * long_dx;
+		auto short_edges_on_left = static_cast<float>(pt2.x) < long_x_at_pt2;
+
+		// Rows below the target's scissor rectangle are skipped in one go rather than walked,
+		// since with guard band clipping a triangle can reach far past the bottom of the screen
+		auto first_y = std::max(pt1.y, static_cast<int>(_height) / 2 - target.max_y);
+
+		// The top row belongs to whatever is above, like the right end of each span belongs to
+		// whatever is to the right, so pixels on an edge shared by two triangles are drawn once.
+		// Rows above the target's scissor rectangle are skipped too.
+		auto last_y = std::min(pt3.y - 1, static_cast<int>(_height) / 2 - target.min_y);
+
+		auto long_rows = static_cast<float>(first_y - pt1.y);
+		auto long_x = static_cast<float>(pt1.x) + long_rows * long_dx;
+		auto long_inv_z = inv_z1 + long_rows * long_dz;
+
+		auto short_x = static_cast<float>(pt1.x);
+		auto short_inv_z = inv_z1;
+		auto short_start_y = pt1.y;
+		if (first_y > pt2.y)
 		{
-			auto idx_into_lists = y - pt1.y;
-
-			// Get the (projected) x coordinates on the left and right for this y line
-			auto x_start = static_cast<int>(x_coords_for_each_y.left[idx_into_lists]);
-			auto x_stop = static_cast<int>(x_coords_for_each_y.right[idx_into_lists]);
-
-			//Get the inverse z coordinates on the left and right for this y line
-			auto zl = inv_z_coords_for_each_y.left[idx_into_lists];
-			auto zr = inv_z_coords_for_each_y.right[idx_into_lists];
-
-			//interpolate the inverse z values from x on the left to x on the right
-			auto zscan = interpolate(x_start, zl, x_stop, zr);
+			short_x = static_cast<float>(pt2.x);
+			short_inv_z = inv_z2;
+			short_dx = compute_step(pt2.y, static_cast<float>(pt2.x), pt3.y, static_cast<float>(pt3.x));
+			short_dz = compute_step(pt2.y, inv_z2, pt3.y, inv_z3);
+			short_start_y = pt2.y;
+		}
+		auto short_rows = static_cast<float>(first_y - short_start_y);
+		short_x += short_rows * short_dx;
+		short_inv_z += short_rows * short_dz;
 
-			for (auto x = x_start; x <= x_stop; ++x)
+		// Draw horizontal segments, walking both edges up one row at a time
+		for (auto y = first_y; y <= last_y; ++y)
+		{
+			if (y == pt2.y)
 			{
-				if(check_and_update_depth_buffer(x,y,zscan[x - x_start]))
-				put_pixel({ x, y }, color);
+				short_x = static_cast<float>(pt2.x);
+				short_inv_z = inv_z2;
+				short_dx = compute_step(pt2.y, static_cast<float>(pt2.x), pt3.y, static_cast<float>(pt3.x));
+				short_dz = compute_step(pt2.y, inv_z2, pt3.y, inv_z3);
 			}
+
+			if (short_edges_on_left)
+				draw_span(target, y, short_x, long_x, short_inv_z, long_inv_z, test_hidden, nearest, color);
+			else
+				draw_span(target, y, long_x, short_x, long_inv_z, short_inv_z, test_hidden, nearest, color);
+
+			long_x += long_dx;
+			long_inv_z += long_dz;
+			short_x += short_dx;
+			short_inv_z += short_dz;
 		}
 	}
 
-	bool check_and_update_depth_buffer(int x, int y, float inverse_z) 
+	// Depth tests and fills one row of a triangle straight into the target's depth and frame buffers.
+	// Covers the pixels from x_left up to, but not including, x_right. With test_hidden, blocks the
+	// triangle is hidden in, going by nearest, its nearest stored depth, are skipped.
+	template <typename Depth>
+	void draw_span(const RasterTarget<Depth>& target, int y, float x_left, float x_right,
+		float inv_z_left, float inv_z_right, bool test_hidden, float nearest, uint32_t color) const
 	{
 		auto w = static_cast<int>(_width);
 		auto h = static_cast<int>(_height);
 
-		//convert the x and y coordinatesfrom (0,0) is center to (0,0) is top left
-		x = w / 2 + x;
-		y = h / 2 - y;
+		//convert the y coordinate from (0,0) is center to (0,0) is top left
+		auto row = h / 2 - y;
+		if (row < target.min_y || row > target.max_y)
+			return;
+
+		auto x_start = static_cast<int>(std::ceil(x_left));
+		auto x_stop = static_cast<int>(std::ceil(x_right)) - 1;
+		if (x_start > x_stop)
+			return;
 
-		//If we're out of bounds, don't display
-		if (x < 0 || x >= w || y < 0 || y >= h)
+		auto inv_z_step = (inv_z_right - inv_z_left) / (x_right - x_left);
+		auto inv_z = inv_z_left + (static_cast<float>(x_start) - x_left) * inv_z_step;
+
+		// Same for x, and trim whatever hangs off the sides of the scissor rectangle
+		auto first = w / 2 + x_start;
+		auto last = w / 2 + x_stop;
+		if (first < target.min_x)
 		{
-			return false;
+			inv_z += static_cast<float>(target.min_x - first) * inv_z_step;
+			first = target.min_x;
 		}
+		if (last > target.max_x)
+			last = target.max_x;
 
-		auto offset = w * y + x;
-		if (_depth_buffer[offset] < inverse_z)
+		// A block's row at a time, since only that much of the row is contiguous in the buffers
+		for (auto x = first; x <= last;)
 		{
-			_depth_buffer[offset] = inverse_z;
-			return true;
+			auto block_x = x - x % TiledLayout::block_size;
+			auto block_last = std::min(last, block_x + TiledLayout::block_size - 1);
+			auto offset = target.layout->get_block_row(block_x, row) - block_x;
+
+			auto block = (offset + block_x) / TiledLayout::block_pixels;
+			auto fills_row = x == block_x && block_last == block_x + TiledLayout::block_size - 1;
+			if (test_hidden && target.hierarchical_z->template is_hidden<Depth>(block, nearest, target.depth, fills_row))
+			{
+				// Stepped like the drawn pixels, so the rest of the row lands on the same depths
+				for (; x <= block_last; ++x)
+					inv_z += inv_z_step;
+				continue;
+			}
+			target.hierarchical_z->mark_drawn(block);
+
+			for (; x <= block_last; ++x)
+			{
+				auto value = Depth::encode(inv_z);
+				auto i = offset + static_cast<size_t>(x);
+				if (target.depth[i] < value)
+				{
+					target.depth[i] = value;
+					target.pixels[i] = color;
+				}
+				inv_z += inv_z_step;
+			}
 		}
-		return false;
 	}
 
-	void draw_line_2d(Vec2i pt1, Vec2i pt2, const Color& color) const
+	void draw_line_2d(Vec2i pt1, Vec2i pt2, const Color& color)
 	{
 		auto dx = pt2.x - pt1.x;
 		auto dy = pt2.y - pt1.y;
@@ -390,21 +1295,35 @@ private:
 		}
 	}
 
-	Vec2i viewport_to_canvas(const Vec2f& pt) const
+	Vec2f viewport_to_canvas(const Vec2f& pt) const
 	{
 		return {
-			static_cast<int>(pt.x * static_cast<float>(_width) / viewport_size),
-			static_cast<int>(pt.y * static_cast<float>(_height) / viewport_size) };
+			pt.x * static_cast<float>(_width) / viewport_size,
+			pt.y * static_cast<float>(_height) / viewport_size };
 	}
 
-	Vec2i project_vertex(const Vec3f& v) const
+	//The pixel the scanline filler puts a canvas point in
+	static Vec2i snap_to_pixel(const Vec2f& pt)
+	{
+		return { static_cast<int>(pt.x), static_cast<int>(pt.y) };
+	}
+
+	//From (0,0) is center and y is up to (0,0) is top left and y is down
+	Vec2f canvas_to_screen(const Vec2f& pt) const
+	{
+		return {
+			static_cast<float>(static_cast<int>(_width) / 2) + pt.x,
+			static_cast<float>(static_cast<int>(_height) / 2) - pt.y };
+	}
+
+	Vec2f project_vertex(const Vec3f& v) const
 	{
 		return viewport_to_canvas({
 			v.x * projection_plane_z / v.z,
 			v.y * projection_plane_z / v.z });
 	}
 
-	Vec2i project_vertex(const Vec4f& v) const
+	Vec2f project_vertex(const Vec4f& v) const
 	{
 		return viewport_to_canvas({
 			v.x * projection_plane_z / v.z,
@@ -428,26 +1347,13 @@ private:
 		return values;
 	}
 
-	// Assumes: y0 > y1 < y2
-	static CorrespondingCoordinateLists
-		interpolate_between_triangle_edges(int y0, float v0, int y1, float v1, int y2, float v2)
+	// How much d changes for each step of i, the same slope interpolate() walks with
+	static float compute_step(int i0, float d0, int i1, float d1)
 	{
-		// Compute dependent (X or Z in all cases as of now) coordinates of the edges.
-		auto x01 = interpolate(y0, v0, y1, v1);
-		auto x12 = interpolate(y1, v1, y2, v2);
-		auto x02 = interpolate(y0, v0, y2, v2);
-
-		// Merge the two short sides.
-		x01.pop_back();
-		x01.insert(x01.end(), x12.begin(), x12.end());
-
-		auto m = x02.size() / 2;
-		auto left = x01;
-		auto right = x02;
-		if (left[m] > right[m])
-			std::swap(left, right);
+		if (i0 == i1)
+			return 0.0f;
 
-		return { left, right };
+		return (d1 - d0) / static_cast<float>(i1 - i0);
 	}
 
 };
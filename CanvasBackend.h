@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Where a finished frame goes. The canvas rasterizes into its own packed
+// 0xAARRGGBB buffer and hands the whole thing to the backend once per frame.
+class CanvasBackend
+{
+public:
+	CanvasBackend(size_t width, size_t height)
+		: _width(width), _height(height)
+	{
+	}
+
+	CanvasBackend(CanvasBackend const&) = delete;
+	CanvasBackend operator = (CanvasBackend const&) = delete;
+
+	virtual ~CanvasBackend() = default;
+
+	size_t get_width() const
+	{
+		return _width;
+	}
+
+	size_t get_height() const
+	{
+		return _height;
+	}
+
+	//Gets a full frame of width * height pixels, row-major, top row first
+	virtual void present(const uint32_t* pixels) = 0;
+
+protected:
+	const size_t _width;
+	const size_t _height;
+};
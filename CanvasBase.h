@@ -1,43 +1,29 @@
 #pragma once
 
-#include <SDL.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 #include "Vec.h"
 #include "Color.h"
+#include "CanvasBackend.h"
 
 class CanvasBase
 {
 public:
-	CanvasBase(const char* window_title, size_t width, size_t height)
-		: _width(width), _height(height)
+	explicit CanvasBase(std::unique_ptr<CanvasBackend> backend)
+		: _width(backend != nullptr ? backend->get_width() : 0)
+		, _height(backend != nullptr ? backend->get_height() : 0)
+		, _backend(std::move(backend))
 	{
-		//Tell SDL we want to do stuff with the screen
-		if (SDL_Init(SDL_INIT_VIDEO) < 0)
+		if (_backend == nullptr)
 		{
-			//If it fails, throw an error
-			throw std::runtime_error(std::string("Could not initialize SDL2: ") + SDL_GetError());
-		}
-
-		//What is the window name, where to spawn it (x,y), width, height, how should the window start
-		_window = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-			static_cast<int>(width), static_cast<int>(height), SDL_WINDOW_SHOWN);
-
-		//If there is no pointer we failed
-		if (_window == nullptr)
-		{
-			throw std::runtime_error(std::string("Could not create window: ") + SDL_GetError());
-		}
-
-		//What window to use, index of the device (-1 means auto pick graphics card), 
-		//the flags we need to be supported,
-		_renderer = SDL_CreateRenderer(_window, -1, 0);
-
-		if (_renderer == nullptr)
-		{
-			throw std::runtime_error(std::string("Could not create renderer: ") + SDL_GetError());
+			throw std::invalid_argument("A canvas needs a backend to present to");
 		}
 
+		_frame_buffer = std::vector<uint32_t>(_width * _height, _clear_color);
 	}
 
 	//Here's how to remove constructors
@@ -49,45 +35,51 @@ public:
 	CanvasBase operator = (CanvasBase const&&) = delete;
 
 
-	virtual ~CanvasBase()
-	{
-		SDL_DestroyRenderer(_renderer);
-		SDL_DestroyWindow(_window);
-	}
+	virtual ~CanvasBase() = default;
 
 	//We are referencing the point and color instead of copying
 	//const makes sure we don't change those guys
-	void put_pixel(const Vec2i& pt, const Color& color) const
+	virtual void put_pixel(const Vec2i& pt, const Color& color)
 	{
-		SDL_SetRenderDrawColor(_renderer, color.r, color.g, color.b, 255);
-
 		//Doin math so that the center of the screen is 0,0
-		SDL_RenderDrawPoint(_renderer,
-			(static_cast<int>(_width) / 2) + pt.x,
-			(static_cast<int>(_height) / 2) - pt.y);
+		auto x = (static_cast<int>(_width) / 2) + pt.x;
+		auto y = (static_cast<int>(_height) / 2) - pt.y;
+
+		//SDL used to drop these for us, now we have to
+		if (x < 0 || x >= static_cast<int>(_width) || y < 0 || y >= static_cast<int>(_height))
+			return;
+
+		_frame_buffer[_width * y + x] = color.to_argb();
 	}
 
 	//Clears out our buffer
 	virtual void clear()
 	{
-		Color _color = Color::zane_brown;
-		SDL_SetRenderDrawColor(_renderer, _color.r, _color.g, _color.b, 255);
-		SDL_RenderClear(_renderer);
+		std::fill(_frame_buffer.begin(), _frame_buffer.end(), _clear_color);
 	}
 
 	//moves the buffer to screen
-	void present() const
+	virtual void present()
 	{
-		SDL_RenderPresent(_renderer);
+		_backend->present(_frame_buffer.data());
+	}
+
+	//Row-major, top row first, 0xAARRGGBB
+	const std::vector<uint32_t>& get_frame_buffer() const
+	{
+		return _frame_buffer;
 	}
 
 protected:
 	const size_t _width;
 	const size_t _height;
 
-private:
-	SDL_Window* _window = nullptr;
-	SDL_Renderer* _renderer = nullptr;
+	//What present hands to the backend
+	std::vector<uint32_t> _frame_buffer{};
 
+	const uint32_t _clear_color = Color::zane_brown.to_argb();
+
+private:
+	std::unique_ptr<CanvasBackend> _backend;
 
-};
\ No newline at end of file
+};
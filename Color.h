@@ -67,6 +67,15 @@ public:
         return { r, g, b } ;
     }
 
+    // Packed the way the canvas frame buffer stores it: 0xAARRGGBB, opaque
+    uint32_t to_argb() const
+    {
+        return 0xFF000000u
+             | ( static_cast<uint32_t>( r ) << 16 )
+             | ( static_cast<uint32_t>( g ) <<  8 )
+             |   static_cast<uint32_t>( b ) ;
+    }
+
 private:
     Color( uint8_t r, uint8_t g, uint8_t b )
         : r( r ), g( g ), b( b )
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "ModelInstance.h"
+
+// Draws recorded for Canvas::execute, which sorts them before drawing anything, rather than
+// drawing in whatever order they were recorded in. Only pointers to the instances are kept, so a
+// buffer can be executed again on later frames, with each instance wherever it has moved to by
+// then, as long as the instances outlive it.
+class CommandBuffer
+{
+public:
+	// Opaque draws go nearest first, so the depth test gets to throw away as much as it can, and
+	// blended ones farthest first, after all of the opaque ones, so each covers what is behind it.
+	// Canvas doesn't blend colors itself yet, so for now blended only changes the order.
+	enum class Pass : uint8_t { opaque, blended };
+
+	void draw(const ModelInstance& instance, Pass pass = Pass::opaque)
+	{
+		_commands.push_back({ &instance, pass });
+	}
+
+	void draw(const std::vector<const ModelInstance*>& instances, Pass pass = Pass::opaque)
+	{
+		for (auto instance : instances)
+			_commands.push_back({ instance, pass });
+	}
+
+	// Starts recording over, keeping the memory
+	void clear()
+	{
+		_commands.clear();
+	}
+
+	size_t size() const
+	{
+		return _commands.size();
+	}
+
+private:
+	friend class Canvas;
+
+	class Command
+	{
+	public:
+		const ModelInstance* instance;
+		Pass pass;
+	};
+
+	std::vector<Command> _commands;
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+#include "Simd.h"
+
+// How the canvas stores each pixel's inverse Z. Larger is closer in all of them, and 0 is as far
+// away as it gets. Canvas clips against a near plane at z = 1, so inverse Z never goes past 1 and
+// the fixed point formats spread their steps over [0, 1]. Anything nearer would saturate.
+enum class DepthFormat
+{
+	float32, // Full precision
+	unorm24, // 24 bits, kept in a 32 bit slot like a GPU's D24X8 so pixels stay aligned
+	unorm16, // Half the memory traffic, for scenes without surfaces close together in the distance
+};
+
+// One class per format, for the rasterizers to be templated on. Each turns the inverse Z they
+// interpolate into its stored value, and depth tests and writes 4 pixels at a time.
+class Float32Depth
+{
+public:
+	using Value = float;
+
+	static Value encode(float inv_z)
+	{
+		return inv_z;
+	}
+
+	// Back to inverse Z, from a stored value held in a float
+	static float decode(float value)
+	{
+		return value;
+	}
+
+	// The farthest of count values, count a multiple of 8 like a block's 64
+	static float get_farthest(const Value* depth, int count)
+	{
+#if RASTERIZER_HAS_SSE2
+		auto farthest = _mm_loadu_ps(depth);
+		for (auto i = 4; i < count; i += 4)
+			farthest = _mm_min_ps(farthest, _mm_loadu_ps(depth + i));
+		farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+		farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtss_f32(farthest);
+#else
+		return *std::min_element(depth, depth + count);
+#endif
+	}
+
+#if RASTERIZER_HAS_SSE2
+	// Writes inv_z wherever it is closer and covered says so, and returns where that was
+	static __m128i test_and_write(Value* depth, __m128 inv_z, __m128i covered)
+	{
+		auto old_depth = _mm_loadu_ps(depth);
+		auto pass = _mm_and_ps(_mm_cmplt_ps(old_depth, inv_z), _mm_castsi128_ps(covered));
+
+		if (_mm_movemask_ps(pass) != 0)
+			_mm_storeu_ps(depth, _mm_or_ps(_mm_and_ps(pass, inv_z), _mm_andnot_ps(pass, old_depth)));
+
+		return _mm_castps_si128(pass);
+	}
+#endif
+};
+
+template <int Bits>
+class UnormDepth
+{
+public:
+	using Value = std::conditional_t<Bits <= 16, uint16_t, uint32_t>;
+
+	static constexpr float max_value = static_cast<float>((1u << Bits) - 1);
+
+	static Value encode(float inv_z)
+	{
+		return static_cast<Value>(std::min(std::max(inv_z * max_value, 0.0f), max_value) + 0.5f);
+	}
+
+	static float decode(float value)
+	{
+		return value / max_value;
+	}
+
+	// As a float, which holds every value up to 24 bits exactly. count is a multiple of 8.
+	static float get_farthest(const Value* depth, int count)
+	{
+#if RASTERIZER_HAS_SSE2
+		if constexpr (sizeof(Value) == 2)
+		{
+			// SSE2 only has a signed 16 bit min, so shift into signed range and back
+			auto sign = _mm_set1_epi16(static_cast<short>(0x8000));
+			auto farthest = _mm_set1_epi16(0x7FFF);
+			for (auto i = 0; i < count; i += 8)
+				farthest = _mm_min_epi16(farthest, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i)), sign));
+			farthest = _mm_min_epi16(farthest, _mm_shuffle_epi32(farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+			farthest = _mm_min_epi16(farthest, _mm_shuffle_epi32(farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+			farthest = _mm_min_epi16(farthest, _mm_shufflelo_epi16(farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+			return static_cast<float>(static_cast<uint16_t>(_mm_cvtsi128_si32(_mm_xor_si128(farthest, sign))));
+		}
+		else
+		{
+			// Nor a 32 bit one at all, but 24 bit values compare the same signed
+			auto farthest = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth));
+			for (auto i = 4; i < count; i += 4)
+				farthest = min_epi32(farthest, _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i)));
+			farthest = min_epi32(farthest, _mm_shuffle_epi32(farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+			farthest = min_epi32(farthest, _mm_shuffle_epi32(farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+			return static_cast<float>(_mm_cvtsi128_si32(farthest));
+		}
+#else
+		return static_cast<float>(*std::min_element(depth, depth + count));
+#endif
+	}
+
+#if RASTERIZER_HAS_SSE2
+	static __m128i test_and_write(Value* depth, __m128 inv_z, __m128i covered)
+	{
+		auto scaled = _mm_min_ps(_mm_max_ps(_mm_mul_ps(inv_z, _mm_set1_ps(max_value)), _mm_setzero_ps()), _mm_set1_ps(max_value));
+		auto value = _mm_cvttps_epi32(_mm_add_ps(scaled, _mm_set1_ps(0.5f)));
+
+		auto old_depth = load(depth);
+		auto pass = _mm_and_si128(_mm_cmpgt_epi32(value, old_depth), covered);
+
+		if (_mm_movemask_epi8(pass) != 0)
+			store(depth, _mm_or_si128(_mm_and_si128(pass, value), _mm_andnot_si128(pass, old_depth)));
+
+		return pass;
+	}
+
+private:
+	static __m128i min_epi32(__m128i a, __m128i b)
+	{
+		auto a_greater = _mm_cmpgt_epi32(a, b);
+		return _mm_or_si128(_mm_and_si128(a_greater, b), _mm_andnot_si128(a_greater, a));
+	}
+
+	// Widened to 32 bits, which even 24 bit values fit in as signed numbers
+	static __m128i load(const Value* depth)
+	{
+		if constexpr (sizeof(Value) == 2)
+			return _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(depth)), _mm_setzero_si128());
+		else
+			return _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth));
+	}
+
+	static void store(Value* depth, __m128i values)
+	{
+		if constexpr (sizeof(Value) == 2)
+		{
+			// SSE2 only packs with signed saturation, so shift into signed range and back
+			auto shifted = _mm_sub_epi32(values, _mm_set1_epi32(0x8000));
+			auto packed = _mm_xor_si128(_mm_packs_epi32(shifted, shifted), _mm_set1_epi16(static_cast<short>(0x8000)));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(depth), packed);
+		}
+		else
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(depth), values);
+		}
+	}
+#endif
+};
+
+using Unorm24Depth = UnormDepth<24>;
+using Unorm16Depth = UnormDepth<16>;
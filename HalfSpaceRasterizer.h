@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "DepthFormat.h"
+#include "HierarchicalZ.h"
+#include "Simd.h"
+#include "TiledLayout.h"
+#include "Vec.h"
+
+// The part of the canvas' depth and frame buffers a triangle may be drawn into. Both buffers are
+// tiled, and Depth is one of DepthFormat's classes. Blocks the depth pyramid says the triangle is
+// hidden in are skipped, and the ones drawn into are marked on it.
+template <typename Depth>
+class RasterTarget
+{
+public:
+	uint32_t*              pixels;
+	typename Depth::Value* depth;
+	const TiledLayout*     layout;
+	HierarchicalZ*         hierarchical_z;
+
+	// Inclusive scissor rectangle in screen pixels, (0,0) is the top left
+	int min_x;
+	int min_y;
+	int max_x;
+	int max_y;
+};
+
+// Edge-function rasterizer that walks the triangle's bounding box in 8x8 pixel blocks.
+// Blocks outside any edge or behind everything already in them are skipped, blocks inside all
+// three edges are filled without testing edges at all, and the rest test 4 pixels at a time.
+//
+// Vertices are snapped to 1/16th of a pixel and pixels are sampled at their centers with
+// the top-left fill rule, so a pixel on an edge shared by two triangles is drawn once.
+class HalfSpaceRasterizer
+{
+public:
+	static constexpr int subpixel_bits  = 4;
+	static constexpr int subpixel_scale = 1 << subpixel_bits;
+	static constexpr int block_size     = 8;
+
+	// Vertices are in screen space: (0,0) is the top left corner and y grows downward
+	template <typename Depth>
+	static void draw_triangle(const RasterTarget<Depth>& target,
+		const Vec2f& v0, const Vec2f& v1, const Vec2f& v2,
+		float inv_z0, float inv_z1, float inv_z2, uint32_t color)
+	{
+		auto p0 = snap(v0);
+		auto p1 = snap(v1);
+		auto p2 = snap(v2);
+
+		// Twice the area, in subpixels. Flip clockwise triangles so the inside is always positive.
+		auto area = evaluate_edge(p0, p1, p2);
+		if (area == 0)
+			return;
+
+		if (area < 0)
+		{
+			std::swap(p1, p2);
+			std::swap(inv_z1, inv_z2);
+			area = -area;
+		}
+
+		// Bounding box in pixels, clipped to the scissor rectangle
+		auto min_x = std::max(target.min_x, to_pixel(std::min({ p0.x, p1.x, p2.x })));
+		auto min_y = std::max(target.min_y, to_pixel(std::min({ p0.y, p1.y, p2.y })));
+		auto max_x = std::min(target.max_x, to_pixel(std::max({ p0.x, p1.x, p2.x })));
+		auto max_y = std::min(target.max_y, to_pixel(std::max({ p0.y, p1.y, p2.y })));
+
+		if (min_x > max_x || min_y > max_y)
+			return;
+
+		// Edge i is the one opposite vertex i, so it also gives that vertex's barycentric weight
+		Edge edges[3] = { make_edge(p1, p2), make_edge(p2, p0), make_edge(p0, p1) };
+
+		// Inverse Z as a plane over the screen, relative to the bounding box's top left pixel
+		auto inv_area = 1.0 / static_cast<double>(area);
+		auto dzdx = static_cast<float>((edges[0].step_x * static_cast<double>(inv_z0)
+			+ edges[1].step_x * static_cast<double>(inv_z1)
+			+ edges[2].step_x * static_cast<double>(inv_z2)) * inv_area);
+		auto dzdy = static_cast<float>((edges[0].step_y * static_cast<double>(inv_z0)
+			+ edges[1].step_y * static_cast<double>(inv_z1)
+			+ edges[2].step_y * static_cast<double>(inv_z2)) * inv_area);
+		auto z_at_min = static_cast<float>((edges[0].value_at(min_x, min_y) * static_cast<double>(inv_z0)
+			+ edges[1].value_at(min_x, min_y) * static_cast<double>(inv_z1)
+			+ edges[2].value_at(min_x, min_y) * static_cast<double>(inv_z2)) * inv_area);
+
+		// Inverse Z is planar, so no pixel of the triangle is nearer than its nearest vertex
+		auto nearest = static_cast<float>(Depth::encode(std::max({ inv_z0, inv_z1, inv_z2 })));
+		auto test_hidden = HierarchicalZ::is_worth_testing(max_x - min_x + 1, max_y - min_y + 1);
+
+		Span span{};
+		span.color = color;
+		span.dzdx = dzdx;
+
+		for (auto by = min_y - min_y % block_size; by <= max_y; by += block_size)
+		for (auto bx = min_x - min_x % block_size; bx <= max_x; bx += block_size)
+		{
+			// Edge functions are linear, so the block's extremes are at its corners
+			auto rejected = false;
+			int64_t block_values[3];
+			bool straddles[3];
+			for (auto i = 0; i < 3 && !rejected; ++i)
+			{
+				auto& edge = edges[i];
+				auto last = block_size - 1;
+				block_values[i] = edge.value_at(bx, by);
+				auto low = block_values[i]
+					+ std::min<int64_t>(0, edge.step_x * last) + std::min<int64_t>(0, edge.step_y * last);
+				auto high = block_values[i]
+					+ std::max<int64_t>(0, edge.step_x * last) + std::max<int64_t>(0, edge.step_y * last);
+				rejected = high < 0;
+				straddles[i] = low < 0;
+			}
+
+			if (rejected)
+				continue;
+
+			auto x_first = std::max(bx, min_x);
+			auto x_last = std::min(bx + block_size - 1, max_x);
+			auto y_first = std::max(by, min_y);
+			auto y_last = std::min(by + block_size - 1, max_y);
+
+			auto fills_block = !straddles[0] && !straddles[1] && !straddles[2]
+				&& x_first == bx && x_last == bx + block_size - 1 && y_first == by && y_last == by + block_size - 1;
+			auto block = target.layout->get_block_row(bx, by) / TiledLayout::block_pixels;
+			if (test_hidden && target.hierarchical_z->template is_hidden<Depth>(block, nearest, target.depth, fills_block))
+				continue;
+			target.hierarchical_z->mark_drawn(block);
+
+			// Only edges that cross the block get tested per pixel. Their values inside the
+			// block are bounded by a few steps, so they fit in 32 bits whatever the screen size.
+			span.edge_count = 0;
+			for (auto i = 0; i < 3; ++i)
+			{
+				if (!straddles[i])
+					continue;
+
+				span.edge_values[span.edge_count] = static_cast<int32_t>(block_values[i]
+					+ (x_first - bx) * edges[i].step_x + (y_first - by) * edges[i].step_y);
+				span.edge_steps_x[span.edge_count] = static_cast<int32_t>(edges[i].step_x);
+				span.edge_steps_y[span.edge_count] = static_cast<int32_t>(edges[i].step_y);
+				++span.edge_count;
+			}
+
+			auto z = z_at_min + static_cast<float>(x_first - min_x) * dzdx
+				+ static_cast<float>(y_first - min_y) * dzdy;
+
+			// A block's rows sit whole in the tiled buffers, so x is counted from the block's left edge
+			for (auto y = y_first; y <= y_last; ++y)
+			{
+				auto offset = target.layout->get_block_row(bx, y);
+				draw_span<Depth>(span, target.pixels + offset, target.depth + offset, x_first - bx, x_last - bx, z);
+
+				z += dzdy;
+				for (auto i = 0; i < span.edge_count; ++i)
+					span.edge_values[i] += span.edge_steps_y[i];
+			}
+		}
+	}
+
+private:
+	class Edge
+	{
+	public:
+		int64_t step_x;
+		int64_t step_y;
+
+		// Value at the center of pixel (0,0), top-left bias included
+		int64_t origin;
+
+		int64_t value_at(int x, int y) const
+		{
+			return origin + x * step_x + y * step_y;
+		}
+	};
+
+	// One row of a block: the edges still to be tested, and where they stand at its first pixel
+	class Span
+	{
+	public:
+		int     edge_count;
+		int32_t edge_values[3];
+		int32_t edge_steps_x[3];
+		int32_t edge_steps_y[3];
+		float   dzdx;
+		uint32_t color;
+	};
+
+	static Vec2i snap(const Vec2f& v)
+	{
+		return {
+			static_cast<int>(std::lround(v.x * subpixel_scale)),
+			static_cast<int>(std::lround(v.y * subpixel_scale)) };
+	}
+
+	// Rounds a subpixel coordinate down to its pixel
+	static int to_pixel(int subpixel)
+	{
+		return subpixel >= 0
+			? subpixel / subpixel_scale
+			: -((-subpixel + subpixel_scale - 1) / subpixel_scale);
+	}
+
+	// Positive when p is to the inside of the edge from a to b
+	static int64_t evaluate_edge(const Vec2i& a, const Vec2i& b, const Vec2i& p)
+	{
+		return static_cast<int64_t>(b.x - a.x) * (p.y - a.y)
+			- static_cast<int64_t>(b.y - a.y) * (p.x - a.x);
+	}
+
+	static Edge make_edge(const Vec2i& a, const Vec2i& b)
+	{
+		auto dx = static_cast<int64_t>(b.x - a.x);
+		auto dy = static_cast<int64_t>(b.y - a.y);
+
+		// A pixel exactly on an edge only belongs to the triangle if the edge is a top edge
+		// (flat, with the inside below it) or a left edge (the inside is to its right)
+		auto is_top_left = dy < 0 || (dy == 0 && dx > 0);
+
+		constexpr auto half = subpixel_scale / 2;
+		Edge edge{};
+		edge.step_x = -dy * subpixel_scale;
+		edge.step_y = dx * subpixel_scale;
+		edge.origin = dx * (half - a.y) - dy * (half - a.x) + (is_top_left ? 0 : -1);
+		return edge;
+	}
+
+	template <typename Depth>
+	static void draw_span(const Span& span, uint32_t* pixels, typename Depth::Value* depth, int x_first, int x_last, float z)
+	{
+		int32_t values[3] = { span.edge_values[0], span.edge_values[1], span.edge_values[2] };
+		auto x = x_first;
+
+#if RASTERIZER_HAS_SSE2
+		auto lanes = _mm_cvtepi32_ps(_mm_set_epi32(3, 2, 1, 0));
+		auto inv_z = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(_mm_set1_ps(span.dzdx), lanes));
+		auto inv_z_step = _mm_set1_ps(4 * span.dzdx);
+		auto color = _mm_set1_epi32(static_cast<int>(span.color));
+		auto outside = _mm_set1_epi32(-1);
+
+		__m128i edge_values[3];
+		__m128i edge_steps[3];
+		for (auto i = 0; i < span.edge_count; ++i)
+		{
+			auto step = span.edge_steps_x[i];
+			edge_values[i] = _mm_add_epi32(_mm_set1_epi32(values[i]), _mm_set_epi32(3 * step, 2 * step, step, 0));
+			edge_steps[i] = _mm_set1_epi32(4 * step);
+		}
+
+		for (; x + 3 <= x_last; x += 4)
+		{
+			auto covered = _mm_set1_epi32(-1);
+			for (auto i = 0; i < span.edge_count; ++i)
+			{
+				covered = _mm_and_si128(covered, _mm_cmpgt_epi32(edge_values[i], outside));
+				edge_values[i] = _mm_add_epi32(edge_values[i], edge_steps[i]);
+			}
+
+			auto pass_bits = Depth::test_and_write(depth + x, inv_z, covered);
+			if (_mm_movemask_epi8(pass_bits) != 0)
+			{
+				auto old_pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + x),
+					_mm_or_si128(_mm_and_si128(pass_bits, color), _mm_andnot_si128(pass_bits, old_pixels)));
+			}
+
+			inv_z = _mm_add_ps(inv_z, inv_z_step);
+		}
+
+		// Catch the scalar values up with the pixels done 4 at a time
+		auto done = x - x_first;
+		for (auto i = 0; i < span.edge_count; ++i)
+			values[i] += done * span.edge_steps_x[i];
+		z += static_cast<float>(done) * span.dzdx;
+#endif
+
+		// Whatever is left of the row, one pixel at a time
+		for (; x <= x_last; ++x)
+		{
+			auto covered = true;
+			for (auto i = 0; i < span.edge_count; ++i)
+			{
+				covered = covered && values[i] >= 0;
+				values[i] += span.edge_steps_x[i];
+			}
+
+			auto value = Depth::encode(z);
+			if (covered && depth[x] < value)
+			{
+				depth[x] = value;
+				pixels[x] = span.color;
+			}
+			z += span.dzdx;
+		}
+	}
+};
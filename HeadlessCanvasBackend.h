@@ -0,0 +1,27 @@
+#pragma once
+
+#include "CanvasBackend.h"
+
+// Never touches SDL, so it works on machines without a display.
+// Frames stay in the canvas' buffer where the caller can read them back.
+class HeadlessCanvasBackend final : public CanvasBackend
+{
+public:
+	HeadlessCanvasBackend(size_t width, size_t height)
+		: CanvasBackend(width, height)
+	{
+	}
+
+	void present(const uint32_t* /*pixels*/) override
+	{
+		++_frames_presented;
+	}
+
+	size_t get_frames_presented() const
+	{
+		return _frames_presented;
+	}
+
+private:
+	size_t _frames_presented = 0;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "DepthFormat.h"
+#include "TiledLayout.h"
+
+// The farthest depth in each 8x8 block of the tiled depth buffer, and in each tile: a two level
+// min pyramid, since larger inverse Z is closer. Anything whose nearest depth is in front of none
+// of a block's pixels can't pass the depth test anywhere in it, so it is skipped without touching
+// a single pixel.
+//
+// Depths are the depth format's stored values, as floats. Drawing only ever brings pixels closer,
+// so the bounds here are never too far, just sometimes too near. Blocks drawn into are marked
+// dirty, and only worked out again when something is tested against them, so triangles that are
+// drawn without anything in front of them cost nothing extra.
+//
+// Like the tiles themselves, each tile's bounds are only used by the worker rasterizing it.
+class HierarchicalZ
+{
+public:
+	explicit HierarchicalZ(const TiledLayout& layout)
+		: _block_farthest(layout.get_tile_count() * TiledLayout::blocks_per_tile, 0.0f)
+		, _tile_farthest(layout.get_tile_count(), 0.0f)
+		, _dirty(layout.get_tile_count(), 0)
+		, _drawn(layout.get_tile_count(), 0)
+	{
+	}
+
+	// For a tile whose depths have just been cleared
+	void clear_tile(size_t tile)
+	{
+		auto first = _block_farthest.begin() + tile * TiledLayout::blocks_per_tile;
+		std::fill(first, first + TiledLayout::blocks_per_tile, 0.0f);
+		_tile_farthest[tile] = 0;
+		_dirty[tile] = 0;
+		_drawn[tile] = 0;
+	}
+
+	// Below this many pixels, a triangle's bounding box has too little in it for testing blocks
+	// to save more than working their bounds out again costs
+	static constexpr int min_tested_area = 4 * TiledLayout::block_pixels;
+
+	static bool is_worth_testing(int width, int height)
+	{
+		return width * height >= min_tested_area;
+	}
+
+	float get_tile_farthest(size_t tile) const
+	{
+		return _tile_farthest[tile];
+	}
+
+	// Only up to date once update_tile has caught the block's tile up
+	float get_block_farthest(size_t block) const
+	{
+		return _block_farthest[block];
+	}
+
+	// Works out every dirty block's bound in the tile again
+	template <typename Depth>
+	void update_tile(size_t tile, const typename Depth::Value* depth)
+	{
+		auto dirty = _dirty[tile] | _drawn[tile];
+		_dirty[tile] = 0;
+		_drawn[tile] = 0;
+
+		for (auto block = 0; dirty != 0; ++block, dirty >>= 1)
+		{
+			if ((dirty & 1) != 0)
+				update_block<Depth>(tile * TiledLayout::blocks_per_tile + block, depth);
+		}
+	}
+
+	// Whether something no nearer than nearest would be hidden everywhere in the block, which is
+	// the index of the block's first pixel in the tiled buffers over block_pixels. depth is the
+	// whole tiled depth buffer, for a dirty block's bound to be worked out again. That is only
+	// worth it for whatever would fill the whole block, or at least whole rows of it: skipping a
+	// sliver saves less than the 64 depths it takes to look at.
+	template <typename Depth>
+	bool is_hidden(size_t block, float nearest, const typename Depth::Value* depth, bool fills_block)
+	{
+		if (nearest < _block_farthest[block])
+			return true;
+
+		auto tile = block / TiledLayout::blocks_per_tile;
+		auto bit = uint64_t{ 1 } << (block % TiledLayout::blocks_per_tile);
+		if (!fills_block || (_dirty[tile] & bit) == 0)
+			return false;
+
+		_dirty[tile] &= ~bit;
+		update_block<Depth>(block, depth);
+		return nearest < _block_farthest[block];
+	}
+
+	// Blocks drawn into only turn dirty once the triangle is finished, so a triangle drawing a block
+	// row by row doesn't work its bound out again for every row
+	void mark_drawn(size_t block)
+	{
+		_drawn[block / TiledLayout::blocks_per_tile] |= uint64_t{ 1 } << (block % TiledLayout::blocks_per_tile);
+	}
+
+	void finish_triangle(size_t tile)
+	{
+		_dirty[tile] |= _drawn[tile];
+		_drawn[tile] = 0;
+	}
+
+private:
+	std::vector<float>    _block_farthest;
+	std::vector<float>    _tile_farthest;
+
+	// One bit per block of each tile
+	std::vector<uint64_t> _dirty;
+	std::vector<uint64_t> _drawn;
+
+	template <typename Depth>
+	void update_block(size_t block, const typename Depth::Value* depth)
+	{
+		auto old_farthest = _block_farthest[block];
+		auto farthest = Depth::get_farthest(depth + block * TiledLayout::block_pixels, TiledLayout::block_pixels);
+		_block_farthest[block] = farthest;
+
+		// The tile's bound can only have moved if this block was what held it back
+		auto tile = block / TiledLayout::blocks_per_tile;
+		if (old_farthest != _tile_farthest[tile] || farthest == old_farthest)
+			return;
+
+		// The blocks' bounds are floats, whatever the depth format
+		auto first = _block_farthest.data() + tile * TiledLayout::blocks_per_tile;
+		_tile_farthest[tile] = Float32Depth::get_farthest(first, TiledLayout::blocks_per_tile);
+	}
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped read-only into memory, unmapped again when this goes away.
+// is_open() is false if the file could not be opened or mapped. An empty file is open,
+// with no data.
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& file_name)
+	{
+#ifdef _WIN32
+		_file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+			return;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size))
+			return;
+
+		// There is nothing to map in an empty file
+		_open = size.QuadPart == 0;
+		if (_open)
+			return;
+
+		_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (_mapping == nullptr)
+			return;
+
+		_data = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+		if (_data != nullptr)
+		{
+			_size = static_cast<size_t>(size.QuadPart);
+			_open = true;
+		}
+#else
+		_file = open(file_name.c_str(), O_RDONLY);
+		if (_file < 0)
+			return;
+
+		struct stat info;
+		if (fstat(_file, &info) != 0)
+			return;
+
+		// There is nothing to map in an empty file
+		_open = info.st_size == 0;
+		if (_open)
+			return;
+
+		auto data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, _file, 0);
+		if (data == MAP_FAILED)
+			return;
+
+		_data = static_cast<const char*>(data);
+		_size = static_cast<size_t>(info.st_size);
+		_open = true;
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (_data != nullptr)
+			UnmapViewOfFile(_data);
+		if (_mapping != nullptr)
+			CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+#else
+		if (_data != nullptr)
+			munmap(const_cast<char*>(_data), _size);
+		if (_file >= 0)
+			close(_file);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool is_open() const
+	{
+		return _open;
+	}
+
+	const char* data() const
+	{
+		return _data;
+	}
+
+	size_t size() const
+	{
+		return _size;
+	}
+
+private:
+	const char* _data = nullptr;
+	size_t      _size = 0;
+	bool        _open = false;
+
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+#else
+	int    _file = -1;
+#endif
+};
@@ -1,34 +1,33 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 
 #include "misc.h"
+#include "Simd.h"
 #include "Vec.h"
 
-class Mat
+// Row major 4x4 matrix. Aligned so each row loads straight into an SSE register.
+class alignas( 16 ) Mat
 {
 public:
     std::array<float, 16> elements = { 0 } ;
 
-    static Mat get_identity_matrix()
+    static constexpr Mat get_identity_matrix()
     {
-        Mat output ;
-        output.elements[  0 ] = 1 ;
-        output.elements[  5 ] = 1 ;
-        output.elements[ 10 ] = 1 ;
-        output.elements[ 15 ] = 1 ;
-        return output ;
+        return { { 1, 0, 0, 0,
+                   0, 1, 0, 0,
+                   0, 0, 1, 0,
+                   0, 0, 0, 1 } } ;
     }
 
-    static Mat get_scale_matrix( float scale )
+    static constexpr Mat get_scale_matrix( float scale )
     {
-        Mat output ;
-        output.elements[  0 ] = scale ;
-        output.elements[  5 ] = scale ;
-        output.elements[ 10 ] = scale ;
-        output.elements[ 15 ] = 1 ;
-        return output ;
+        return { { scale,     0,     0, 0,
+                       0, scale,     0, 0,
+                       0,     0, scale, 0,
+                       0,     0,     0, 1 } } ;
     }
 
     static Mat get_rotation_matrix( float degrees, const Vec3f& around )
@@ -54,17 +53,12 @@ public:
         return output ;
     }
 
-    static Mat get_translation_matrix( Vec3f translation )
+    static constexpr Mat get_translation_matrix( Vec3f translation )
     {
-        Mat output ;
-        output.elements[  0 ] = 1 ;
-        output.elements[  3 ] = translation.x ;
-        output.elements[  5 ] = 1 ;
-        output.elements[  7 ] = translation.y ;
-        output.elements[ 10 ] = 1 ;
-        output.elements[ 11 ] = translation.z ;
-        output.elements[ 15 ] = 1 ;
-        return output ;
+        return { { 1, 0, 0, translation.x,
+                   0, 1, 0, translation.y,
+                   0, 0, 1, translation.z,
+                   0, 0, 0,             1 } } ;
     }
 
     //Rows to collumns, collumns to row
@@ -78,6 +72,31 @@ public:
     }
 
     Mat multiply( const Mat& other ) const
+    {
+#if RASTERIZER_HAS_SSE2
+        Mat output ;
+        // Each row of the product is the other matrix's rows, weighted by this row's elements
+        auto row0 = _mm_load_ps( &other.elements[  0 ] ) ;
+        auto row1 = _mm_load_ps( &other.elements[  4 ] ) ;
+        auto row2 = _mm_load_ps( &other.elements[  8 ] ) ;
+        auto row3 = _mm_load_ps( &other.elements[ 12 ] ) ;
+        for( size_t i = 0 ; i < 4 ; ++i )
+        {
+            auto sum = _mm_add_ps( _mm_add_ps( _mm_add_ps(
+                _mm_mul_ps( _mm_set1_ps( elements[ i * 4 + 0 ] ), row0 ),
+                _mm_mul_ps( _mm_set1_ps( elements[ i * 4 + 1 ] ), row1 ) ),
+                _mm_mul_ps( _mm_set1_ps( elements[ i * 4 + 2 ] ), row2 ) ),
+                _mm_mul_ps( _mm_set1_ps( elements[ i * 4 + 3 ] ), row3 ) ) ;
+            _mm_store_ps( &output.elements[ i * 4 ], sum ) ;
+        }
+        return output ;
+#else
+        return multiply_scalar( other ) ;
+#endif
+    }
+
+    // What multiply does without SSE2, kept callable for comparing the two
+    Mat multiply_scalar( const Mat& other ) const
     {
         Mat output ;
         for( size_t i = 0 ; i < 4 ; ++i )
@@ -87,6 +106,65 @@ public:
         return output ;
     }
 
+    // The product of two affine matrices, whose bottom rows are ( 0, 0, 0, 1 ). Anything built
+    // from rotations, scales and translations is, and skipping that row saves a quarter of the work.
+    Mat multiply_affine( const Mat& other ) const
+    {
+#if RASTERIZER_HAS_SSE2
+        Mat output ;
+        auto row0 = _mm_load_ps( &other.elements[ 0 ] ) ;
+        auto row1 = _mm_load_ps( &other.elements[ 4 ] ) ;
+        auto row2 = _mm_load_ps( &other.elements[ 8 ] ) ;
+        for( size_t i = 0 ; i < 3 ; ++i )
+        {
+            // Other's bottom row only passes this row's translation through
+            auto sum = _mm_add_ps( _mm_add_ps( _mm_add_ps(
+                _mm_mul_ps( _mm_set1_ps( elements[ i * 4 + 0 ] ), row0 ),
+                _mm_mul_ps( _mm_set1_ps( elements[ i * 4 + 1 ] ), row1 ) ),
+                _mm_mul_ps( _mm_set1_ps( elements[ i * 4 + 2 ] ), row2 ) ),
+                _mm_set_ps( elements[ i * 4 + 3 ], 0, 0, 0 ) ) ;
+            _mm_store_ps( &output.elements[ i * 4 ], sum ) ;
+        }
+        output.elements[ 15 ] = 1 ;
+        return output ;
+#else
+        return multiply_affine_scalar( other ) ;
+#endif
+    }
+
+    Mat multiply_affine_scalar( const Mat& other ) const
+    {
+        Mat output ;
+        for( size_t i = 0 ; i < 3 ; ++i )
+        {
+            for( size_t j = 0 ; j < 4 ; ++j )
+            for( size_t k = 0 ; k < 3 ; ++k )
+                output.elements[ i * 4 + j ] += elements[ i * 4 + k ] * other.elements[ k * 4 + j ] ;
+            output.elements[ i * 4 + 3 ] += elements[ i * 4 + 3 ] ;
+        }
+        output.elements[ 15 ] = 1 ;
+        return output ;
+    }
+
+    // Transforms a point by an affine matrix, without working out a w that is always 1
+    Vec3f multiply_affine( const Vec3f& vector ) const
+    {
+        return { elements[ 0 ] * vector.x + elements[ 1 ] * vector.y + elements[  2 ] * vector.z + elements[  3 ],
+                 elements[ 4 ] * vector.x + elements[ 5 ] * vector.y + elements[  6 ] * vector.z + elements[  7 ],
+                 elements[ 8 ] * vector.x + elements[ 9 ] * vector.y + elements[ 10 ] * vector.z + elements[ 11 ] } ;
+    }
+
+    // The most an affine matrix stretches any length, which is its largest scale when it is
+    // built from rotations, scales and translations. Bounding sphere radii grow by this much.
+    float get_affine_scale() const
+    {
+        auto column_length_squared = [ this ]( size_t j )
+        {
+            return elements[ j ] * elements[ j ] + elements[ 4 + j ] * elements[ 4 + j ] + elements[ 8 + j ] * elements[ 8 + j ] ;
+        } ;
+        return std::sqrt( std::max( { column_length_squared( 0 ), column_length_squared( 1 ), column_length_squared( 2 ) } ) ) ;
+    }
+
     //This should 
     Vec4f multiply( const Vec3f& vector ) const
     {
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "Mat.h"
+
+// Times Mat's products against their plain C++ versions, for main's --bench-mat. Each product
+// feeds the next, like a transform hierarchy being composed, so the compiler can't overlap them
+// or throw any away.
+class MatBenchmark
+{
+public:
+	static void run(std::ostream& out)
+	{
+		// Rotations and translations, like everything ModelInstance and the camera build
+		std::mt19937 random(1);
+		std::uniform_real_distribution<float> unit(-1, 1);
+		std::vector<Mat> matrices(matrix_count);
+		for (auto& matrix : matrices)
+		{
+			matrix = Mat::get_translation_matrix({ unit(random), unit(random), unit(random) })
+				.multiply(Mat::get_rotation_matrix(unit(random) * 180, { unit(random), unit(random), 1 }));
+		}
+
+		// Neither SSE2 nor skipping the bottom row should change the answer
+		auto max_difference = 0.0f;
+		for (size_t i = 0; i + 1 < matrices.size(); ++i)
+		{
+			auto full = matrices[i].multiply(matrices[i + 1]);
+			auto affine = matrices[i].multiply_affine(matrices[i + 1]);
+			auto scalar = matrices[i].multiply_scalar(matrices[i + 1]);
+			for (size_t j = 0; j < 16; ++j)
+			{
+				max_difference = std::max(max_difference, std::abs(full.elements[j] - affine.elements[j]));
+				max_difference = std::max(max_difference, std::abs(full.elements[j] - scalar.elements[j]));
+			}
+		}
+		out << "Largest difference between products: " << max_difference << std::endl;
+
+#if RASTERIZER_HAS_SSE2
+		out << "multiply (SSE2):          "
+			<< time(matrices, [](const Mat& a, const Mat& b) { return a.multiply(b); }) << " ns" << std::endl;
+		out << "multiply_affine (SSE2):   "
+			<< time(matrices, [](const Mat& a, const Mat& b) { return a.multiply_affine(b); }) << " ns" << std::endl;
+#endif
+		out << "multiply (scalar):        "
+			<< time(matrices, [](const Mat& a, const Mat& b) { return a.multiply_scalar(b); }) << " ns" << std::endl;
+		out << "multiply_affine (scalar): "
+			<< time(matrices, [](const Mat& a, const Mat& b) { return a.multiply_affine_scalar(b); }) << " ns" << std::endl;
+	}
+
+private:
+	static constexpr size_t matrix_count = 1024;
+	static constexpr int    repeats = 2000;
+
+	// Nanoseconds per product
+	template <typename Product>
+	static double time(const std::vector<Mat>& matrices, Product&& product)
+	{
+		auto result = Mat::get_identity_matrix();
+		auto start = std::chrono::steady_clock::now();
+		for (auto repeat = 0; repeat < repeats; ++repeat)
+		{
+			for (auto& matrix : matrices)
+				result = product(result, matrix);
+		}
+		auto stop = std::chrono::steady_clock::now();
+
+		// Read back, so the chain can't be optimized away
+		volatile auto sink = result.elements[0];
+		(void)sink;
+
+		return std::chrono::duration<double, std::nano>(stop - start).count() / (static_cast<double>(repeats) * matrices.size());
+	}
+};
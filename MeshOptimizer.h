@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "Vec.h"
+#include "Meshlet.h"
+#include "Plane.h"
+#include "Triangle.h"
+
+// Load-time clean up of a mesh, for models exported with a copy of each vertex per triangle:
+//
+//    1. Vertices at exactly the same position are welded into one, and vertices no triangle
+//       uses are dropped.
+//    2. Triangles are sorted into meshlets, then each meshlet's triangles are put in Tipsify
+//       order, so consecutive triangles share as many vertices as they can.
+//    3. Vertices are renumbered in the order the triangles first use them, so a meshlet's
+//       vertices sit next to each other and transforming them touches few batches.
+//
+// Triangles only carry a color, so welding never merges anything that should stay apart.
+class MeshOptimizer
+{
+public:
+    // Vertices Tipsify assumes stay at hand, like the post-transform cache on a GPU
+    static constexpr uint32_t cache_size = 16 ;
+
+    class Mesh
+    {
+    public:
+        std::vector<Vec3f>    vertices    ;
+        std::vector<Triangle> triangles   ;
+        std::vector<Plane>    face_planes ;
+        std::vector<Meshlet>  meshlets    ;
+    } ;
+
+    static Mesh optimize( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles )
+    {
+        std::vector<Vec3f> welded_vertices ;
+        auto welded = weld_vertices( vertices, triangles, welded_vertices ) ;
+        auto sorted = Meshlet::sort_triangles( welded_vertices, welded ) ;
+
+        std::vector<Plane> sorted_planes ;
+        sorted_planes.reserve( sorted.size() ) ;
+        for( auto& triangle : sorted )
+        {
+            sorted_planes.push_back( Meshlet::compute_face_plane( welded_vertices[ triangle.vertex_indices.x ],
+                                                                  welded_vertices[ triangle.vertex_indices.y ],
+                                                                  welded_vertices[ triangle.vertex_indices.z ] ) ) ;
+        }
+
+        // Reordering inside a meshlet leaves its bounds and cone as they were
+        Mesh mesh ;
+        mesh.meshlets = Meshlet::build( welded_vertices, sorted, sorted_planes ) ;
+
+        std::vector<uint32_t> order ;
+        order.reserve( sorted.size() ) ;
+        for( auto& meshlet : mesh.meshlets )
+            tipsify( sorted, meshlet.first_triangle, meshlet.triangle_count, order ) ;
+
+        mesh.triangles.reserve( sorted.size() ) ;
+        mesh.face_planes.reserve( sorted.size() ) ;
+        for( auto t : order )
+        {
+            mesh.triangles.push_back( sorted[ t ] ) ;
+            mesh.face_planes.push_back( sorted_planes[ t ] ) ;
+        }
+
+        renumber_vertices( welded_vertices, mesh ) ;
+        return mesh ;
+    }
+
+    // For meshes that came out of optimize() before and were saved, which it would only shuffle
+    // again. Works out the face planes and meshlets without changing anything.
+    static Mesh prepare_optimized( std::vector<Vec3f> vertices, std::vector<Triangle> triangles )
+    {
+        Mesh mesh ;
+        mesh.vertices = std::move( vertices ) ;
+        mesh.triangles = std::move( triangles ) ;
+
+        mesh.face_planes.reserve( mesh.triangles.size() ) ;
+        for( auto& triangle : mesh.triangles )
+        {
+            mesh.face_planes.push_back( Meshlet::compute_face_plane( mesh.vertices[ triangle.vertex_indices.x ],
+                                                                     mesh.vertices[ triangle.vertex_indices.y ],
+                                                                     mesh.vertices[ triangle.vertex_indices.z ] ) ) ;
+        }
+
+        mesh.meshlets = Meshlet::build( mesh.vertices, mesh.triangles, mesh.face_planes ) ;
+        return mesh ;
+    }
+
+private:
+    class PositionKey
+    {
+    public:
+        uint32_t bits[ 3 ] ;
+
+        bool operator==( const PositionKey& other ) const
+        {
+            return bits[ 0 ] == other.bits[ 0 ] && bits[ 1 ] == other.bits[ 1 ] && bits[ 2 ] == other.bits[ 2 ] ;
+        }
+    } ;
+
+    class PositionHash
+    {
+    public:
+        size_t operator()( const PositionKey& key ) const
+        {
+            uint64_t hash = 14695981039346656037ull ;
+            for( auto bits : key.bits )
+                hash = ( hash ^ bits ) * 1099511628211ull ;
+            return static_cast<size_t>( hash ) ;
+        }
+    } ;
+
+    static PositionKey get_key( const Vec3f& position )
+    {
+        // Adding zero turns -0 into +0, which would otherwise hash differently
+        float coordinates[ 3 ] = { position.x + 0.0f, position.y + 0.0f, position.z + 0.0f } ;
+        PositionKey key ;
+        std::memcpy( key.bits, coordinates, sizeof( key.bits ) ) ;
+        return key ;
+    }
+
+    static std::vector<Triangle> weld_vertices( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles,
+                                                std::vector<Vec3f>& welded_vertices )
+    {
+        std::unordered_map<PositionKey, int, PositionHash> first_at ;
+        first_at.reserve( vertices.size() ) ;
+
+        std::vector<int> remap ;
+        remap.reserve( vertices.size() ) ;
+        for( auto& vertex : vertices )
+        {
+            auto inserted = first_at.emplace( get_key( vertex ), static_cast<int>( welded_vertices.size() ) ) ;
+            if( inserted.second )
+                welded_vertices.push_back( vertex ) ;
+            remap.push_back( inserted.first->second ) ;
+        }
+
+        return make_triangles( triangles.size(), [ & ]( size_t i ) -> Triangle
+        {
+            auto& indices = triangles[ i ].vertex_indices ;
+            return { { remap[ indices.x ], remap[ indices.y ], remap[ indices.z ] }, triangles[ i ].color } ;
+        } ) ;
+    }
+
+    // Sander, Nehab and Barczak's Tipsify, for triangles [first, first + count). Walks from vertex
+    // to vertex, emitting every triangle left around the current one as a fan, and picks the next
+    // vertex among the fan's: the one that will still be in the cache after its remaining triangles
+    // have gone through, if any, else one from the dead end stack, else the next one with triangles left.
+    static void tipsify( const std::vector<Triangle>& triangles, uint32_t first, uint32_t count,
+                         std::vector<uint32_t>& order )
+    {
+        // The meshlet's own vertices, numbered from 0
+        std::vector<int> globals ;
+        for( auto t = first ; t < first + count ; ++t )
+        {
+            auto& indices = triangles[ t ].vertex_indices ;
+            globals.insert( globals.end(), { indices.x, indices.y, indices.z } ) ;
+        }
+        std::sort( globals.begin(), globals.end() ) ;
+        globals.erase( std::unique( globals.begin(), globals.end() ), globals.end() ) ;
+
+        auto local = [ & ]( int global )
+        {
+            return static_cast<uint32_t>( std::lower_bound( globals.begin(), globals.end(), global ) - globals.begin() ) ;
+        } ;
+
+        auto vertex_count = static_cast<uint32_t>( globals.size() ) ;
+        std::vector<uint32_t> corners ;
+        std::vector<std::vector<uint32_t>> adjacent( vertex_count ) ;
+        for( uint32_t t = 0 ; t < count ; ++t )
+        {
+            auto& indices = triangles[ first + t ].vertex_indices ;
+            for( auto global : { indices.x, indices.y, indices.z } )
+            {
+                corners.push_back( local( global ) ) ;
+                adjacent[ corners.back() ].push_back( t ) ;
+            }
+        }
+
+        std::vector<uint32_t> live( vertex_count ) ;
+        for( uint32_t v = 0 ; v < vertex_count ; ++v )
+            live[ v ] = static_cast<uint32_t>( adjacent[ v ].size() ) ;
+
+        std::vector<uint32_t> cached_at( vertex_count, 0 ) ;
+        std::vector<bool>     emitted( count, false ) ;
+        std::vector<uint32_t> dead_ends ;
+        uint32_t time = cache_size + 1 ;
+        uint32_t cursor = 0 ;
+        int fan = 0 ;
+
+        while( fan >= 0 )
+        {
+            std::vector<uint32_t> candidates ;
+            for( auto t : adjacent[ fan ] )
+            {
+                if( emitted[ t ] )
+                    continue ;
+
+                order.push_back( first + t ) ;
+                emitted[ t ] = true ;
+                for( auto corner = t * 3 ; corner < t * 3 + 3 ; ++corner )
+                {
+                    auto v = corners[ corner ] ;
+                    dead_ends.push_back( v ) ;
+                    candidates.push_back( v ) ;
+                    --live[ v ] ;
+                    if( time - cached_at[ v ] > cache_size )
+                        cached_at[ v ] = time++ ;
+                }
+            }
+
+            fan = -1 ;
+            auto best_priority = -1 ;
+            for( auto v : candidates )
+            {
+                if( live[ v ] == 0 )
+                    continue ;
+
+                auto priority = 0 ;
+                if( time - cached_at[ v ] + 2 * live[ v ] <= cache_size )
+                    priority = static_cast<int>( time - cached_at[ v ] ) ;
+                if( priority > best_priority )
+                {
+                    best_priority = priority ;
+                    fan = static_cast<int>( v ) ;
+                }
+            }
+
+            while( fan < 0 && !dead_ends.empty() )
+            {
+                auto v = dead_ends.back() ;
+                dead_ends.pop_back() ;
+                if( live[ v ] > 0 )
+                    fan = static_cast<int>( v ) ;
+            }
+
+            for( ; fan < 0 && cursor < vertex_count ; ++cursor )
+            {
+                if( live[ cursor ] > 0 )
+                    fan = static_cast<int>( cursor ) ;
+            }
+        }
+    }
+
+    // Numbers vertices in the order the triangles first use them, leaving out unused ones
+    static void renumber_vertices( const std::vector<Vec3f>& vertices, Mesh& mesh )
+    {
+        constexpr int unused = -1 ;
+        std::vector<int> remap( vertices.size(), unused ) ;
+        mesh.vertices.reserve( vertices.size() ) ;
+
+        auto renumber = [ & ]( int index )
+        {
+            if( remap[ index ] == unused )
+            {
+                remap[ index ] = static_cast<int>( mesh.vertices.size() ) ;
+                mesh.vertices.push_back( vertices[ index ] ) ;
+            }
+            return remap[ index ] ;
+        } ;
+
+        std::vector<Triangle> renumbered ;
+        renumbered.reserve( mesh.triangles.size() ) ;
+        for( auto& triangle : mesh.triangles )
+        {
+            auto& indices = triangle.vertex_indices ;
+            auto x = renumber( indices.x ) ;
+            auto y = renumber( indices.y ) ;
+            auto z = renumber( indices.z ) ;
+            renumbered.push_back( { { x, y, z }, triangle.color } ) ;
+        }
+
+        mesh.triangles = std::move( renumbered ) ;
+    }
+} ;
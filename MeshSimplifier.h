@@ -0,0 +1,389 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <queue>
+#include <vector>
+
+#include "misc.h"
+#include "Vec.h"
+#include "Triangle.h"
+
+// Garland and Heckbert's quadric error simplification. Every vertex carries the sum of the squared
+// distance functions to the planes of the triangles around it, weighted by their areas, and edges
+// are collapsed cheapest first, each to the point where the two vertices' sums are smallest.
+//
+// Triangles keep their colors. Collapses that would turn a triangle over are skipped, and edges
+// on the border of an open mesh are held in place by extra planes standing up along them.
+class MeshSimplifier
+{
+public:
+    class Result
+    {
+    public:
+        std::vector<Vec3f>    vertices  ;
+        std::vector<Triangle> triangles ;
+
+        // Roughly how far the surface moved, in model units: the root of the mean squared distance
+        // to the original planes, for the worst collapse made
+        float                 error     ;
+    } ;
+
+    // Collapses edges until no more than target_triangle_count triangles are left, or none can go
+    // without turning a triangle over. Vertices no triangle uses any more are left in place.
+    static Result simplify( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles,
+                            size_t target_triangle_count )
+    {
+        State state( vertices, triangles ) ;
+
+        for( uint32_t v = 0 ; v < state.positions.size() ; ++v )
+            push_edges( state, v ) ;
+
+        auto live_count = static_cast<size_t>( std::count( state.live_triangles.begin(), state.live_triangles.end(), true ) ) ;
+        auto max_cost = 0.0 ;
+
+        while( live_count > target_triangle_count && !state.candidates.empty() )
+        {
+            auto candidate = state.candidates.top() ;
+            state.candidates.pop() ;
+
+            // Either end may have moved, or gone, since the collapse was costed
+            if( !state.live_vertices[ candidate.from ] || !state.live_vertices[ candidate.to ]
+             || state.versions[ candidate.from ] != candidate.from_version
+             || state.versions[ candidate.to ] != candidate.to_version )
+                continue ;
+
+            if( flips_triangle( state, candidate.from, candidate.to, candidate.position )
+             || flips_triangle( state, candidate.to, candidate.from, candidate.position ) )
+                continue ;
+
+            live_count -= collapse( state, candidate.from, candidate.to, candidate.position ) ;
+            max_cost = std::max( max_cost, candidate.cost ) ;
+            push_edges( state, candidate.to ) ;
+        }
+
+        Result result ;
+        result.vertices = std::move( state.positions ) ;
+        result.triangles.reserve( live_count ) ;
+        for( size_t t = 0 ; t < triangles.size() ; ++t )
+        {
+            if( state.live_triangles[ t ] )
+                result.triangles.push_back( { state.corners[ t ], triangles[ t ].color } ) ;
+        }
+        result.error = static_cast<float>( std::sqrt( max_cost ) ) ;
+        return result ;
+    }
+
+private:
+    // How much more an edge along an open border counts than the triangle it belongs to
+    static constexpr double border_weight = 10 ;
+
+    // The symmetric 4x4 matrix of a sum of squared plane distances, upper triangle only, and the
+    // sum of the weights that went into it
+    class Quadric
+    {
+    public:
+        double xx = 0, xy = 0, xz = 0, xw = 0 ;
+        double         yy = 0, yz = 0, yw = 0 ;
+        double                 zz = 0, zw = 0 ;
+        double                         ww = 0 ;
+        double weight = 0 ;
+
+        // n.p + d = 0, n being unit length
+        static Quadric from_plane( double nx, double ny, double nz, double d, double weight )
+        {
+            Quadric q ;
+            q.xx = weight * nx * nx ; q.xy = weight * nx * ny ; q.xz = weight * nx * nz ; q.xw = weight * nx * d ;
+            q.yy = weight * ny * ny ; q.yz = weight * ny * nz ; q.yw = weight * ny * d ;
+            q.zz = weight * nz * nz ; q.zw = weight * nz * d ;
+            q.ww = weight * d * d ;
+            q.weight = weight ;
+            return q ;
+        }
+
+        Quadric& operator+=( const Quadric& other )
+        {
+            xx += other.xx ; xy += other.xy ; xz += other.xz ; xw += other.xw ;
+            yy += other.yy ; yz += other.yz ; yw += other.yw ;
+            zz += other.zz ; zw += other.zw ;
+            ww += other.ww ;
+            weight += other.weight ;
+            return *this ;
+        }
+
+        // The mean squared distance from p to the planes
+        double evaluate( const Vec3f& p ) const
+        {
+            double x = p.x, y = p.y, z = p.z ;
+            auto sum = x * x * xx + 2 * x * y * xy + 2 * x * z * xz + 2 * x * xw
+                     + y * y * yy + 2 * y * z * yz + 2 * y * yw
+                     + z * z * zz + 2 * z * zw
+                     + ww ;
+            return weight > 0 ? std::max( 0.0, sum / weight ) : 0 ;
+        }
+
+        // Where evaluate() is smallest, if there is a single such point
+        bool find_minimum( Vec3f& minimum ) const
+        {
+            auto det = xx * ( yy * zz - yz * yz ) - xy * ( xy * zz - yz * xz ) + xz * ( xy * yz - yy * xz ) ;
+            // By Hadamard's inequality det is at most the diagonal's product, so this is how
+            // well the planes pin a point down, from 1 for three at right angles to 0
+            if( !( std::abs( det ) > 1e-9 * std::abs( xx * yy * zz ) ) )
+                return false ;
+
+            // Cramer's rule on A p = -b
+            auto bx = -xw, by = -yw, bz = -zw ;
+            minimum.x = static_cast<float>( ( bx * ( yy * zz - yz * yz ) - xy * ( by * zz - yz * bz ) + xz * ( by * yz - yy * bz ) ) / det ) ;
+            minimum.y = static_cast<float>( ( xx * ( by * zz - yz * bz ) - bx * ( xy * zz - yz * xz ) + xz * ( xy * bz - by * xz ) ) / det ) ;
+            minimum.z = static_cast<float>( ( xx * ( yy * bz - by * yz ) - xy * ( xy * bz - by * xz ) + bx * ( xy * yz - yy * xz ) ) / det ) ;
+            return true ;
+        }
+    } ;
+
+    // Moving from into to, at position
+    class Candidate
+    {
+    public:
+        double   cost         ;
+        Vec3f    position     ;
+        uint32_t from         ;
+        uint32_t to           ;
+        uint32_t from_version ;
+        uint32_t to_version   ;
+
+        // Cheapest on top of the priority queue
+        bool operator<( const Candidate& other ) const
+        {
+            return cost > other.cost ;
+        }
+    } ;
+
+    class State
+    {
+    public:
+        std::vector<Vec3f>                 positions      ;
+        std::vector<Vec3i>                 corners        ;
+        std::vector<bool>                  live_vertices  ;
+        std::vector<bool>                  live_triangles ;
+        std::vector<Quadric>               quadrics       ;
+        std::vector<uint32_t>              versions       ;
+        std::vector<std::vector<uint32_t>> adjacent       ;
+        std::priority_queue<Candidate>     candidates     ;
+
+        State( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles )
+            : positions( vertices )
+            , live_vertices( vertices.size(), true )
+            , live_triangles( triangles.size(), true )
+            , quadrics( vertices.size() )
+            , versions( vertices.size(), 0 )
+            , adjacent( vertices.size() )
+        {
+            corners.reserve( triangles.size() ) ;
+            for( uint32_t t = 0 ; t < triangles.size() ; ++t )
+            {
+                auto& indices = triangles[ t ].vertex_indices ;
+                corners.push_back( indices ) ;
+
+                // Triangles using a vertex twice, like the ones around the poles of some spheres,
+                // cover nothing and only get in the way of telling where the borders are
+                if( indices.x == indices.y || indices.y == indices.z || indices.z == indices.x )
+                {
+                    live_triangles[ t ] = false ;
+                    continue ;
+                }
+
+                for( auto v : { indices.x, indices.y, indices.z } )
+                    adjacent[ v ].push_back( t ) ;
+
+                add_triangle_quadric( t ) ;
+            }
+
+            add_border_quadrics() ;
+        }
+
+    private:
+        void add_triangle_quadric( uint32_t t )
+        {
+            auto& indices = corners[ t ] ;
+            auto& v0 = positions[ indices.x ] ;
+            auto normal = compute_triangle_normal( v0, positions[ indices.y ], positions[ indices.z ] ) ;
+            auto length = std::sqrt( compute_dot_product( normal, normal ) ) ;
+            if( length == 0 )
+                return ;
+
+            // The cross product is twice the area
+            auto n = ( 1 / length ) * normal ;
+            auto q = Quadric::from_plane( n.x, n.y, n.z, -compute_dot_product( n, v0 ), length / 2 ) ;
+            for( auto v : { indices.x, indices.y, indices.z } )
+                quadrics[ v ] += q ;
+        }
+
+        // An edge used by only one triangle, counting both directions, is on a border
+        void add_border_quadrics()
+        {
+            for( uint32_t t = 0 ; t < corners.size() ; ++t )
+            {
+                auto& indices = corners[ t ] ;
+                int ring[ 3 ] = { indices.x, indices.y, indices.z } ;
+                for( auto e = 0 ; e < 3 ; ++e )
+                {
+                    auto a = ring[ e ] ;
+                    auto b = ring[ ( e + 1 ) % 3 ] ;
+                    if( count_triangles_with( a, b ) == 1 )
+                        add_border_quadric( t, a, b ) ;
+                }
+            }
+        }
+
+        size_t count_triangles_with( int a, int b ) const
+        {
+            size_t count = 0 ;
+            for( auto t : adjacent[ a ] )
+            {
+                auto& indices = corners[ t ] ;
+                count += indices.x == b || indices.y == b || indices.z == b ;
+            }
+            return count ;
+        }
+
+        // A plane through the edge at right angles to the triangle
+        void add_border_quadric( uint32_t t, int a, int b )
+        {
+            auto& indices = corners[ t ] ;
+            auto normal = compute_triangle_normal( positions[ indices.x ], positions[ indices.y ], positions[ indices.z ] ) ;
+            auto edge = positions[ b ] - positions[ a ] ;
+            Vec3f side { edge.y * normal.z - edge.z * normal.y,
+                         edge.z * normal.x - edge.x * normal.z,
+                         edge.x * normal.y - edge.y * normal.x } ;
+            auto length = std::sqrt( compute_dot_product( side, side ) ) ;
+            if( length == 0 )
+                return ;
+
+            auto n = ( 1 / length ) * side ;
+            auto q = Quadric::from_plane( n.x, n.y, n.z, -compute_dot_product( n, positions[ a ] ),
+                                          border_weight * compute_dot_product( edge, edge ) ) ;
+            quadrics[ a ] += q ;
+            quadrics[ b ] += q ;
+        }
+    } ;
+
+    // Queues a collapse of v along each of its edges, wherever the far end is best off
+    static void push_edges( State& state, uint32_t v )
+    {
+        for( auto t : state.adjacent[ v ] )
+        {
+            auto& indices = state.corners[ t ] ;
+            for( auto other : { indices.x, indices.y, indices.z } )
+            {
+                if( static_cast<uint32_t>( other ) != v )
+                    push_candidate( state, v, static_cast<uint32_t>( other ) ) ;
+            }
+        }
+    }
+
+    static void push_candidate( State& state, uint32_t from, uint32_t to )
+    {
+        auto quadric = state.quadrics[ from ] ;
+        quadric += state.quadrics[ to ] ;
+
+        auto& a = state.positions[ from ] ;
+        auto& b = state.positions[ to ] ;
+        auto midpoint = 0.5f * ( a + b ) ;
+
+        // Either end, the middle, or the minimum when it isn't wildly far off: nearly flat
+        // neighbourhoods put it anywhere along the plane
+        Candidate best { quadric.evaluate( b ), b, from, to, state.versions[ from ], state.versions[ to ] } ;
+        auto consider = [ & ]( const Vec3f& position )
+        {
+            auto cost = quadric.evaluate( position ) ;
+            if( cost < best.cost )
+            {
+                best.cost = cost ;
+                best.position = position ;
+            }
+        } ;
+        consider( a ) ;
+        consider( midpoint ) ;
+
+        Vec3f minimum ;
+        auto edge = b - a ;
+        if( quadric.find_minimum( minimum ) )
+        {
+            auto offset = minimum - midpoint ;
+            if( compute_dot_product( offset, offset ) <= compute_dot_product( edge, edge ) )
+                consider( minimum ) ;
+        }
+
+        state.candidates.push( best ) ;
+    }
+
+    // Whether moving v to position turns over any of its triangles that don't also hold other,
+    // which go away with the collapse
+    static bool flips_triangle( const State& state, uint32_t v, uint32_t other, const Vec3f& position )
+    {
+        for( auto t : state.adjacent[ v ] )
+        {
+            if( !state.live_triangles[ t ] )
+                continue ;
+
+            auto& indices = state.corners[ t ] ;
+            if( static_cast<uint32_t>( indices.x ) == other || static_cast<uint32_t>( indices.y ) == other
+             || static_cast<uint32_t>( indices.z ) == other )
+                continue ;
+
+            int ring[ 3 ] = { indices.x, indices.y, indices.z } ;
+            Vec3f moved[ 3 ] ;
+            for( auto c = 0 ; c < 3 ; ++c )
+                moved[ c ] = static_cast<uint32_t>( ring[ c ] ) == v ? position : state.positions[ ring[ c ] ] ;
+
+            auto before = compute_triangle_normal( state.positions[ ring[ 0 ] ], state.positions[ ring[ 1 ] ], state.positions[ ring[ 2 ] ] ) ;
+            auto after = compute_triangle_normal( moved[ 0 ], moved[ 1 ], moved[ 2 ] ) ;
+
+            if( compute_dot_product( before, after ) <= 0 )
+                return true ;
+        }
+        return false ;
+    }
+
+    // Merges from into to, returning how many triangles went away
+    static size_t collapse( State& state, uint32_t from, uint32_t to, const Vec3f& position )
+    {
+        state.positions[ to ] = position ;
+        state.quadrics[ to ] += state.quadrics[ from ] ;
+        state.live_vertices[ from ] = false ;
+        ++state.versions[ to ] ;
+
+        size_t removed = 0 ;
+        auto& kept = state.adjacent[ to ] ;
+        for( auto t : state.adjacent[ from ] )
+        {
+            if( !state.live_triangles[ t ] )
+                continue ;
+
+            auto& indices = state.corners[ t ] ;
+            if( indices.x == static_cast<int>( to ) || indices.y == static_cast<int>( to ) || indices.z == static_cast<int>( to ) )
+            {
+                state.live_triangles[ t ] = false ;
+                ++removed ;
+                continue ;
+            }
+
+            for( auto corner : { &indices.x, &indices.y, &indices.z } )
+            {
+                if( *corner == static_cast<int>( from ) )
+                    *corner = static_cast<int>( to ) ;
+            }
+            kept.push_back( t ) ;
+        }
+
+        kept.erase( std::remove_if( kept.begin(), kept.end(), [ & ]( uint32_t t )
+        {
+            return !state.live_triangles[ t ] ;
+        } ), kept.end() ) ;
+
+        state.adjacent[ from ].clear() ;
+        state.adjacent[ from ].shrink_to_fit() ;
+        return removed ;
+    }
+} ;
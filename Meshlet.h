@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "misc.h"
+#include "Plane.h"
+#include "Sphere.h"
+#include "Triangle.h"
+#include "Vec.h"
+
+// A run of a model's triangles that face roughly the same way, with a cone around all of their
+// normals. Seen from anywhere behind the cone, every one of them faces away, so the whole run can
+// be culled with one test instead of one per triangle.
+class Meshlet
+{
+public:
+    static constexpr uint32_t max_triangles = 64 ;
+
+    uint32_t first_triangle ;
+    uint32_t triangle_count ;
+    Sphere   bounds         ;
+
+    // Unit axis of the normal cone, and the sine of the angle between it and the normal furthest
+    // from it. A cutoff of 1 means the normals spread too far for the cone to ever cull anything.
+    Vec3f    cone_axis      ;
+    float    cone_cutoff    ;
+
+    // Whether all of the triangles face away from an eye in the model's space
+    bool is_back_facing( const Vec3f& eye ) const
+    {
+        if( cone_cutoff >= 1 )
+            return false ;
+
+        auto to_center = bounds.center - eye ;
+        auto distance = std::sqrt( compute_dot_product( to_center, to_center ) ) ;
+        return compute_dot_product( to_center, cone_axis ) >= cone_cutoff * distance + bounds.radius ;
+    }
+
+    // The model's triangles wind clockwise seen from the front, so this points out of the front.
+    // Zero length for degenerate triangles, which never face anything.
+    static Plane compute_face_plane( const Vec3f& v0, const Vec3f& v1, const Vec3f& v2 )
+    {
+        auto normal = -compute_triangle_normal( v0, v1, v2 ) ;
+        auto length = std::sqrt( compute_dot_product( normal, normal ) ) ;
+        if( length > 0 )
+            normal = ( 1 / length ) * normal ;
+
+        return { normal, -compute_dot_product( normal, v0 ) } ;
+    }
+
+    // The triangles grouped by which of the six axis directions they face most, and within a group
+    // along a Z-order curve through their centers, so the runs cut from it are compact patches
+    static std::vector<Triangle> sort_triangles( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles )
+    {
+        if( triangles.empty() )
+            return {} ;
+
+        auto min = vertices[ 0 ] ;
+        auto max = vertices[ 0 ] ;
+        for( auto& vertex : vertices )
+        {
+            min = { std::min( min.x, vertex.x ), std::min( min.y, vertex.y ), std::min( min.z, vertex.z ) } ;
+            max = { std::max( max.x, vertex.x ), std::max( max.y, vertex.y ), std::max( max.z, vertex.z ) } ;
+        }
+
+        // Group in the top bits, the curve below
+        std::vector<uint64_t> keys ;
+        keys.reserve( triangles.size() ) ;
+        for( auto& triangle : triangles )
+        {
+            auto& v0 = vertices[ triangle.vertex_indices.x ] ;
+            auto& v1 = vertices[ triangle.vertex_indices.y ] ;
+            auto& v2 = vertices[ triangle.vertex_indices.z ] ;
+            auto center = ( 1.0f / 3 ) * ( v0 + v1 + v2 ) ;
+
+            auto group = get_facing_group( compute_face_plane( v0, v1, v2 ).normal ) ;
+            keys.push_back( static_cast<uint64_t>( group ) << 60
+                          | interleave( quantize( center.x, min.x, max.x ) )
+                          | interleave( quantize( center.y, min.y, max.y ) ) << 1
+                          | interleave( quantize( center.z, min.z, max.z ) ) << 2 ) ;
+        }
+
+        std::vector<uint32_t> order( triangles.size() ) ;
+        for( uint32_t i = 0 ; i < order.size() ; ++i )
+            order[ i ] = i ;
+        std::stable_sort( order.begin(), order.end(), [ & ]( uint32_t a, uint32_t b )
+        {
+            return keys[ a ] < keys[ b ] ;
+        } ) ;
+
+        return make_triangles( order.size(), [ & ]( size_t i )
+        {
+            return triangles[ order[ i ] ] ;
+        } ) ;
+    }
+
+    // Splits triangles that went through sort_triangles into meshlets of up to max_triangles
+    static std::vector<Meshlet> build( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles,
+                                       const std::vector<Plane>& face_planes )
+    {
+        std::vector<Meshlet> meshlets ;
+
+        uint32_t first = 0 ;
+        while( first < triangles.size() )
+        {
+            auto group = get_facing_group( face_planes[ first ].normal ) ;
+            auto last = first + 1 ;
+            while( last < triangles.size() && last - first < max_triangles
+                && get_facing_group( face_planes[ last ].normal ) == group )
+                ++last ;
+
+            meshlets.push_back( make_meshlet( vertices, triangles, face_planes, first, last - first ) ) ;
+            first = last ;
+        }
+
+        return meshlets ;
+    }
+
+private:
+    // 0 to 1023 across the model's bounds
+    static uint32_t quantize( float value, float min, float max )
+    {
+        if( max <= min )
+            return 0 ;
+        return static_cast<uint32_t>( std::min( 1023.0f, ( value - min ) / ( max - min ) * 1024 ) ) ;
+    }
+
+    // Spreads 10 bits out to every third bit
+    static uint64_t interleave( uint32_t bits )
+    {
+        uint64_t x = bits & 0x3FF ;
+        x = ( x | x << 16 ) & 0x030000FF ;
+        x = ( x | x <<  8 ) & 0x0300F00F ;
+        x = ( x | x <<  4 ) & 0x030C30C3 ;
+        x = ( x | x <<  2 ) & 0x09249249 ;
+        return x ;
+    }
+
+    // +x, -x, +y, -y, +z, -z
+    static uint8_t get_facing_group( const Vec3f& normal )
+    {
+        auto x = std::abs( normal.x ) ;
+        auto y = std::abs( normal.y ) ;
+        auto z = std::abs( normal.z ) ;
+
+        if( x >= y && x >= z )
+            return normal.x >= 0 ? 0 : 1 ;
+        if( y >= z )
+            return normal.y >= 0 ? 2 : 3 ;
+        return normal.z >= 0 ? 4 : 5 ;
+    }
+
+    static Meshlet make_meshlet( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles,
+                                 const std::vector<Plane>& face_planes, uint32_t first, uint32_t count )
+    {
+        Meshlet meshlet ;
+        meshlet.first_triangle = first ;
+        meshlet.triangle_count = count ;
+
+        // Sphere around the middle of the triangles' bounding box
+        auto min = vertices[ triangles[ first ].vertex_indices.x ] ;
+        auto max = min ;
+        for_each_vertex( triangles, first, count, [ & ]( int index )
+        {
+            auto& vertex = vertices[ index ] ;
+            min = { std::min( min.x, vertex.x ), std::min( min.y, vertex.y ), std::min( min.z, vertex.z ) } ;
+            max = { std::max( max.x, vertex.x ), std::max( max.y, vertex.y ), std::max( max.z, vertex.z ) } ;
+        } ) ;
+
+        auto center = 0.5f * ( min + max ) ;
+        auto radius_squared = 0.0f ;
+        for_each_vertex( triangles, first, count, [ & ]( int index )
+        {
+            auto offset = vertices[ index ] - center ;
+            radius_squared = std::max( radius_squared, compute_dot_product( offset, offset ) ) ;
+        } ) ;
+        meshlet.bounds = { center, std::sqrt( radius_squared ) } ;
+
+        // The cone's axis is the normals' average, and it is as wide as the one furthest from it.
+        // Degenerate triangles have no normal, and are culled whichever way they are seen.
+        Vec3f sum { 0, 0, 0 } ;
+        for( auto i = first ; i < first + count ; ++i )
+            sum = sum + face_planes[ i ].normal ;
+
+        auto length = std::sqrt( compute_dot_product( sum, sum ) ) ;
+        meshlet.cone_axis = { 0, 0, 0 } ;
+        meshlet.cone_cutoff = 1 ;
+        if( length == 0 )
+            return meshlet ;
+
+        auto axis = ( 1 / length ) * sum ;
+        auto min_cosine = 1.0f ;
+        for( auto i = first ; i < first + count ; ++i )
+        {
+            auto& normal = face_planes[ i ].normal ;
+            if( compute_dot_product( normal, normal ) > 0 )
+                min_cosine = std::min( min_cosine, compute_dot_product( axis, normal ) ) ;
+        }
+
+        // Past a right angle there is nowhere every triangle faces away from
+        if( min_cosine <= 0 )
+            return meshlet ;
+
+        meshlet.cone_axis = axis ;
+        meshlet.cone_cutoff = std::sqrt( 1 - min_cosine * min_cosine ) ;
+        return meshlet ;
+    }
+
+    template <typename Visit>
+    static void for_each_vertex( const std::vector<Triangle>& triangles, uint32_t first, uint32_t count, Visit&& visit )
+    {
+        for( auto i = first ; i < first + count ; ++i )
+        {
+            auto& indices = triangles[ i ].vertex_indices ;
+            visit( indices.x ) ;
+            visit( indices.y ) ;
+            visit( indices.z ) ;
+        }
+    }
+} ;
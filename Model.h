@@ -1,78 +1,224 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <memory>
 #include <vector>
 
 #include "Vec.h"
+#include "Meshlet.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "Plane.h"
+#include "SoaVertices.h"
 #include "Sphere.h"
 #include "Triangle.h"
 
+// Meshes go through MeshOptimizer on the way in, so neither the vertices nor the triangles stay
+// as they were given. Triangles are grouped into meshlets, runs of triangles facing much the same
+// way, so backface culling can drop whole runs at once.
+//
+// Each model also carries a chain of simpler versions of itself, made with MeshSimplifier, for
+// drawing it when it only covers a few pixels.
 class Model
 {
 public:
+    // A simpler version of the model, and roughly how far its surface strays from the full
+    // model's, in model units
+    class Lod
+    {
+    public:
+        std::unique_ptr<const Model> model ;
+        float                        error ;
+    } ;
+
     const std::vector<Vec3f>    vertices        ;
     const std::vector<Triangle> triangles       ;
     const Sphere                bounding_sphere ;
 
-    Model( std::vector<Vec3f> vertices, std::vector<Triangle> triangles )
-        : vertices( std::move( vertices ) )
-        , triangles( std::move( triangles ) )
-        , bounding_sphere( compute_bounding_sphere() )
+    // The same positions, one array per coordinate and padded to whole batches, for VertexTransform
+    const SoaVertices           soa_vertices    ;
+
+    // One per triangle, with the normal pointing out of its front and unit length
+    const std::vector<Plane>    face_planes     ;
+    const std::vector<Meshlet>  meshlets        ;
+
+    // Coarser and coarser, each with about half the triangles of the one before, and errors that
+    // only grow along the chain. Empty for models too small to be worth simplifying.
+    const std::vector<Lod>      lods            ;
+
+    Model( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles )
+        : Model( MeshOptimizer::optimize( vertices, triangles ), nullptr, nullptr )
+    {
+    }
+
+    // For formats that store a model after it went through MeshOptimizer, along with its bounding
+    // sphere and levels of detail, so none of them are worked out again on every load
+    Model( std::vector<Vec3f> vertices, std::vector<Triangle> triangles, const Sphere& bounding_sphere, std::vector<Lod> lods )
+        : Model( MeshOptimizer::prepare_optimized( std::move( vertices ), std::move( triangles ) ), &bounding_sphere, &lods )
+    {
+    }
+
+    // The same, for formats that store the face planes and meshlets too, so nothing is left to do
+    Model( MeshOptimizer::Mesh mesh, const Sphere& bounding_sphere, std::vector<Lod> lods )
+        : Model( std::move( mesh ), &bounding_sphere, &lods )
+    {
+    }
+
+    // Level 0 is the model itself, and level n its n-th simpler version
+    size_t get_lod_count() const
     {
+        return lods.size() + 1 ;
+    }
+
+    const Model& get_lod( size_t level ) const
+    {
+        return level == 0 ? *this : *lods[ level - 1 ].model ;
+    }
+
+    // The coarsest level whose error stays within max_pixel_error, for a model whose bounding
+    // sphere reaches projected_radius pixels across the screen
+    size_t get_coarsest_lod( float projected_radius, float max_pixel_error ) const
+    {
+        if( bounding_sphere.radius <= 0 )
+            return 0 ;
+
+        auto pixels_per_unit = projected_radius / bounding_sphere.radius ;
+        size_t level = 0 ;
+        while( level < lods.size() && lods[ level ].error * pixels_per_unit <= max_pixel_error )
+            ++level ;
+
+        return level ;
+    }
+
+    // get_coarsest_lod, except that the current level is kept until the projected radius has
+    // moved lod_hysteresis times past the point where the pick changes, so a model sitting right
+    // at that distance doesn't keep popping between two levels
+    size_t select_lod( float projected_radius, float max_pixel_error, size_t current ) const
+    {
+        auto finest = get_coarsest_lod( projected_radius * lod_hysteresis, max_pixel_error ) ;
+        auto coarsest = get_coarsest_lod( projected_radius / lod_hysteresis, max_pixel_error ) ;
+        return std::min( std::max( current, finest ), coarsest ) ;
     }
 
 private:
+    static constexpr size_t max_lod_count     = 8 ;
+    // Anything smaller is cheap enough to draw as it is
+    static constexpr size_t min_lod_triangles = 128 ;
+    static constexpr float  lod_hysteresis    = 1.25f ;
+
+    // Leaving given_lods out works the levels of detail out from the mesh
+    Model( MeshOptimizer::Mesh mesh, const Sphere* bounding_sphere, std::vector<Lod>* given_lods )
+        : vertices( std::move( mesh.vertices ) )
+        , triangles( std::move( mesh.triangles ) )
+        , bounding_sphere( bounding_sphere != nullptr ? *bounding_sphere : compute_bounding_sphere() )
+        , soa_vertices( this->vertices )
+        , face_planes( std::move( mesh.face_planes ) )
+        , meshlets( std::move( mesh.meshlets ) )
+        , lods( given_lods != nullptr ? std::move( *given_lods ) : build_lods( this->vertices, this->triangles ) )
+    {
+    }
+
+    // Each level is simplified from the one before, which is much quicker than starting from the
+    // full model every time, so their errors add up
+    static std::vector<Lod> build_lods( const std::vector<Vec3f>& vertices, const std::vector<Triangle>& triangles )
+    {
+        std::vector<Lod> lods ;
+        auto source_vertices = &vertices ;
+        auto source_triangles = &triangles ;
+        auto error = 0.0f ;
+
+        while( lods.size() < max_lod_count && source_triangles->size() / 2 >= min_lod_triangles )
+        {
+            auto target = source_triangles->size() / 2 ;
+            auto simplified = MeshSimplifier::simplify( *source_vertices, *source_triangles, target ) ;
+
+            // Stuck well short of the target, since the rest can't go without turning triangles over
+            if( simplified.triangles.size() > source_triangles->size() * 3 / 4 )
+                break ;
+
+            error += simplified.error ;
+            std::vector<Lod> none ;
+            auto mesh = MeshOptimizer::optimize( simplified.vertices, simplified.triangles ) ;
+            lods.push_back( { std::unique_ptr<const Model>( new Model( std::move( mesh ), nullptr, &none ) ), error } ) ;
+
+            source_vertices = &lods.back().model->vertices ;
+            source_triangles = &lods.back().model->triangles ;
+        }
+
+        return lods ;
+    }
+
+    // Ritter's bounding sphere: start from two points far apart, then grow the sphere just
+    // enough to take in each vertex that is still outside of it. Usually within a few percent
+    // of the smallest sphere, and much tighter than one around the corners of the bounding box.
     Sphere compute_bounding_sphere() const
     {
         if( vertices.empty() )
             return { { 0, 0, 0 }, 0 } ;
 
-        Vec3f mins { vertices[ 0 ].x, vertices[ 0 ].y, vertices[ 0 ].z } ;
-        Vec3f maxs { vertices[ 0 ].x, vertices[ 0 ].y, vertices[ 0 ].z } ;
+        auto& a = vertices[ get_farthest_vertex( vertices[ 0 ] ) ] ;
+        auto& b = vertices[ get_farthest_vertex( a ) ] ;
+
+        Vec3f center { ( a.x + b.x ) / 2,
+                       ( a.y + b.y ) / 2,
+                       ( a.z + b.z ) / 2 } ;
 
-        for( size_t i = 1 ; i < vertices.size() ; ++i  )
+        auto radius = std::sqrt( get_distance_squared( center, a ) ) ;
+
+        for( auto& vertex : vertices )
         {
-            if( vertices[ i ].x < mins.x ) mins.x = vertices[ i ].x ;
-            if( vertices[ i ].y < mins.y ) mins.y = vertices[ i ].y ;
-            if( vertices[ i ].z < mins.z ) mins.z = vertices[ i ].z ;
-            if( vertices[ i ].x > maxs.x ) maxs.x = vertices[ i ].x ;
-            if( vertices[ i ].y > maxs.y ) maxs.y = vertices[ i ].y ;
-            if( vertices[ i ].z > maxs.z ) maxs.z = vertices[ i ].z ;
+            auto distance = std::sqrt( get_distance_squared( center, vertex ) ) ;
+            if( distance <= radius )
+                continue ;
+
+            // Move the center toward the vertex so the far side of the old sphere stays put
+            auto new_radius = ( radius + distance ) / 2 ;
+            auto shift = ( new_radius - radius ) / distance ;
+
+            center.x += ( vertex.x - center.x ) * shift ;
+            center.y += ( vertex.y - center.y ) * shift ;
+            center.z += ( vertex.z - center.z ) * shift ;
+            radius = new_radius ;
         }
 
-        Vec3f centroid { ( mins.x + maxs.x ) / 2,
-                         ( mins.y + maxs.y ) / 2 ,
-                         ( mins.z + maxs.z ) / 2 } ;
-
-        float radius_squared = 0 ;
-
-        Vec3f corner3 { mins.x, mins.y, maxs.z } ;
-        Vec3f corner4 { mins.x, maxs.y, maxs.z } ;
-        Vec3f corner5 { mins.x, maxs.y, mins.z } ;
-        Vec3f corner6 { maxs.x, mins.y, mins.z } ;
-        Vec3f corner7 { maxs.x, mins.y, maxs.z } ;
-        Vec3f corner8 { maxs.x, maxs.y, mins.z } ;
-
-        radius_squared = get_max_distance_squared( centroid,    mins, radius_squared ) ;
-        radius_squared = get_max_distance_squared( centroid,    maxs, radius_squared ) ;
-        radius_squared = get_max_distance_squared( centroid, corner3, radius_squared ) ;
-        radius_squared = get_max_distance_squared( centroid, corner4, radius_squared ) ;
-        radius_squared = get_max_distance_squared( centroid, corner5, radius_squared ) ;
-        radius_squared = get_max_distance_squared( centroid, corner6, radius_squared ) ;
-        radius_squared = get_max_distance_squared( centroid, corner7, radius_squared ) ;
-        radius_squared = get_max_distance_squared( centroid, corner8, radius_squared ) ;
-
-        return { centroid, std::sqrt( radius_squared ) } ;
+        // Rounding while growing can leave a vertex a hair outside, so take the real maximum
+        auto radius_squared = 0.0f ;
+        for( auto& vertex : vertices )
+            radius_squared = get_max_distance_squared( center, vertex, radius_squared ) ;
+
+        return { center, std::sqrt( radius_squared ) } ;
+    }
+
+    size_t get_farthest_vertex( const Vec3f& from ) const
+    {
+        size_t farthest = 0 ;
+        auto farthest_distance_squared = -1.0f ;
+
+        for( size_t i = 0 ; i < vertices.size() ; ++i )
+        {
+            auto distance_squared = get_distance_squared( from, vertices[ i ] ) ;
+            if( distance_squared > farthest_distance_squared )
+            {
+                farthest = i ;
+                farthest_distance_squared = distance_squared ;
+            }
+        }
+
+        return farthest ;
     }
 
     static float get_max_distance_squared(
         const Vec3f& centroid, const Vec3f& corner, float max_radius_squred_so_far )
     {
-        auto dist_squared = ( corner.x - centroid.x ) * ( corner.x - centroid.x )
-                          + ( corner.y - centroid.y ) * ( corner.y - centroid.y )
-                          + ( corner.z - centroid.z ) * ( corner.z - centroid.z ) ;
+        return std::max( get_distance_squared( centroid, corner ), max_radius_squred_so_far ) ;
+    }
 
-        return std::max( dist_squared, max_radius_squred_so_far ) ;
+    static float get_distance_squared( const Vec3f& a, const Vec3f& b )
+    {
+        return ( b.x - a.x ) * ( b.x - a.x )
+             + ( b.y - a.y ) * ( b.y - a.y )
+             + ( b.z - a.z ) * ( b.z - a.z ) ;
     }
 
 } ;
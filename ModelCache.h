@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "A3DBModel.h"
+#include "BinaryModel.h"
+#include "Model.h"
+#include "Sphere.h"
+
+// One model file as the ModelCache hands it out. It starts out loading, with only the placeholder
+// bounding sphere it was asked for with, and turns into either a loaded model or an error.
+class ModelAsset
+{
+public:
+	enum class State { loading, loaded, failed };
+
+	const std::string& get_path() const
+	{
+		return _path;
+	}
+
+	State get_state() const
+	{
+		return _state.load(std::memory_order_acquire);
+	}
+
+	// nullptr until the model has loaded
+	const Model* get_model() const
+	{
+		return get_state() == State::loaded ? _model.get() : nullptr;
+	}
+
+	// The model's bounding sphere once it has loaded, the placeholder until then
+	const Sphere& get_bounding_sphere() const
+	{
+		auto model = get_model();
+		return model != nullptr ? model->bounding_sphere : _placeholder_bounds;
+	}
+
+	// Only meaningful once the state is failed
+	const std::string& get_error() const
+	{
+		return _error;
+	}
+
+	// Blocks until the asset has either loaded or failed
+	void wait() const
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_done.wait(lock, [this] { return get_state() != State::loading; });
+	}
+
+private:
+	friend class ModelCache;
+
+	std::string             _path;
+	Sphere                  _placeholder_bounds;
+	std::atomic<State>      _state{ State::loading };
+	std::unique_ptr<Model>  _model;
+	std::string             _error;
+
+	mutable std::mutex              _mutex;
+	mutable std::condition_variable _done;
+
+	ModelAsset(std::string path, const Sphere& placeholder_bounds)
+		: _path(std::move(path)),
+		_placeholder_bounds(placeholder_bounds)
+	{
+	}
+};
+
+// Shared, refcounted handle to a model asset. The asset goes away with the last handle.
+using ModelHandle = std::shared_ptr<const ModelAsset>;
+
+// Hands out one asset per model file, however many times it is asked for, and loads them in
+// order on its own I/O thread so rendering can start before they have all arrived.
+//
+// Files ending in .a3mb are read as BinaryModel, anything else as A3DBModel.
+class ModelCache
+{
+public:
+	ModelCache()
+		: _io_thread([this] { run_loads(); })
+	{
+	}
+
+	ModelCache(ModelCache const&) = delete;
+	ModelCache& operator=(ModelCache const&) = delete;
+
+	// Loads still queued are abandoned, and their assets fail
+	~ModelCache()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_work_available.notify_one();
+		_io_thread.join();
+
+		for (auto& asset : _queue)
+			finish(*asset, nullptr, "the model cache was destroyed before this loaded");
+	}
+
+	// The handle for the file, queueing a load the first time it is asked for, or again after
+	// every handle to it went away. Until it arrives, the asset's bounds are placeholder_bounds.
+	ModelHandle load(const std::string& path, const Sphere& placeholder_bounds = { { 0, 0, 0 }, 1 })
+	{
+		auto key = std::filesystem::path(path).lexically_normal().string();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		auto existing = _assets.find(key);
+		if (existing != _assets.end())
+		{
+			if (auto asset = existing->second.lock())
+				return asset;
+		}
+
+		// Not make_shared, since the constructor is private to everyone but the cache. Replaces
+		// the file's entry if it has expired. Only here and remove_unused ever drop entries.
+		auto asset = std::shared_ptr<ModelAsset>(new ModelAsset(key, placeholder_bounds));
+		_assets[key] = asset;
+		_queue.push_back(asset);
+		_work_available.notify_one();
+		return asset;
+	}
+
+	// Forgets files nobody holds a handle to any more
+	void remove_unused()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto i = _assets.begin(); i != _assets.end();)
+			i = i->second.expired() ? _assets.erase(i) : std::next(i);
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _work_available;
+	bool _stopping = false;
+
+	std::unordered_map<std::string, std::weak_ptr<ModelAsset>> _assets;
+	std::deque<std::shared_ptr<ModelAsset>> _queue;
+
+	// Declared last, so everything it uses is there before it starts
+	std::thread _io_thread;
+
+	void run_loads()
+	{
+		for (;;)
+		{
+			std::shared_ptr<ModelAsset> asset;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_work_available.wait(lock, [this] { return _stopping || !_queue.empty(); });
+
+				if (_stopping)
+					return;
+
+				asset = std::move(_queue.front());
+				_queue.pop_front();
+
+				// Every handle went away while it was queued, so nobody can see it any more.
+				// Checked under the lock, so load() can't hand it out again in the meantime. The
+				// map is left alone: the entry expires along with the asset, and load() replaces it.
+				if (asset.use_count() == 1)
+					continue;
+			}
+
+			try
+			{
+				auto model = load_file(asset->_path);
+				if (model == nullptr)
+					finish(*asset, nullptr, asset->_path + ": not a valid model file");
+				else
+					finish(*asset, std::move(model), {});
+			}
+			catch (const std::exception& e)
+			{
+				finish(*asset, nullptr, e.what());
+			}
+		}
+	}
+
+	static std::unique_ptr<Model> load_file(const std::string& path)
+	{
+		if (std::filesystem::path(path).extension() == ".a3mb")
+			return BinaryModel::load(path);
+		return A3DBModel::load(path);
+	}
+
+	static void finish(ModelAsset& asset, std::unique_ptr<Model> model, std::string error)
+	{
+		{
+			std::lock_guard<std::mutex> lock(asset._mutex);
+			asset._model = std::move(model);
+			asset._error = std::move(error);
+			asset._state.store(asset._model != nullptr ? ModelAsset::State::loaded : ModelAsset::State::failed,
+				std::memory_order_release);
+		}
+		asset._done.notify_all();
+	}
+};
@@ -1,83 +1,135 @@
 #pragma once
+#include <cstdint>
+#include <vector>
 #include "Mat.h"
 #include "Vec.h"
 #include "Model.h"
+#include "ModelCache.h"
+#include "Quat.h"
+#include "TransformNode.h"
 
-class ModelInstance
+class Scene;
+
+// A model placed in the world. Instances can hang off each other, or off any other TransformNode,
+// and move with whatever they hang off.
+class ModelInstance : public TransformNode
 {
 public: 
-	const Model& model;
-
 	explicit ModelInstance(const Model& model,
 		const Vec3f& translation = { 0, 0, 0 },
 		float scale = 1,
 		float rotation_angle = 0,
 		const Vec3f& rotation_axis = { 1,0,0 })
-		: model(model),
-		_translation(translation),
-		_scale(scale),
-		_rotation_angle(rotation_angle),
-		_rotation_axis(rotation_axis),
-		_transform(Mat::get_identity_matrix())
+		: TransformNode(translation, scale, Quat::get_rotation(rotation_angle, rotation_axis)),
+		_model(&model)
 	{
-		compute_transform();
 	}
 
-	const Mat& get_transformation() const
+	//Shares ownership of the asset, which may still be loading
+	explicit ModelInstance(ModelHandle asset,
+		const Vec3f& translation = { 0, 0, 0 },
+		float scale = 1,
+		float rotation_angle = 0,
+		const Vec3f& rotation_axis = { 1,0,0 })
+		: TransformNode(translation, scale, Quat::get_rotation(rotation_angle, rotation_axis)),
+		_asset(std::move(asset))
 	{
-		return _transform;
 	}
 
-	const Vec3f& get_translation() const
+	//nullptr while the instance's asset hasn't loaded, or if it failed to
+	const Model* get_model() const
 	{
-		return _translation;
+		return _asset != nullptr ? _asset->get_model() : _model;
 	}
 
-	void set_translation(const Vec3f& translation) 
+	//In model space. Until the asset loads, this is the placeholder it was requested with.
+	const Sphere& get_bounding_sphere() const
 	{
-		_translation = translation;
-		compute_transform();
+		return _asset != nullptr ? _asset->get_bounding_sphere() : _model->bounding_sphere;
 	}
 
-	float get_scale() const
+	//Model to world
+	const Mat& get_transformation() const
 	{
-		return _scale;
+		return get_world_transform();
 	}
 
-	float set_scale(float scale)
+	//Model to camera, kept until either the world transform or the camera changes. camera_id has
+	//to change whenever camera_transform does, and is never 0.
+	const Mat& get_model_view(const Mat& camera_transform, uint64_t camera_id) const
 	{
-		_scale = scale; 
-		compute_transform();
+		auto world_version = get_world_version();
+		if (_model_view.camera_id != camera_id || _model_view.world_version != world_version)
+		{
+			_model_view.transform = camera_transform.multiply_affine(get_world_transform());
+			_model_view.camera_id = camera_id;
+			_model_view.world_version = world_version;
+		}
+		return _model_view.transform;
 	}
 
-	float get_rotation_angle() const
+	//The model's level of detail to draw, given how many pixels its bounding sphere reaches across
+	//the screen. The last pick is kept for Model::select_lod, so like get_model_view this is meant
+	//for one canvas at a time. nullptr while the asset hasn't loaded.
+	const Model* select_lod(float projected_radius, float max_pixel_error) const
 	{
-		return _rotation_angle;
+		auto model = get_model();
+		if (model == nullptr)
+			return nullptr;
+
+		_lod_level = model->select_lod(projected_radius, max_pixel_error, _lod_level);
+		return &model->get_lod(_lod_level);
 	}
 
-	const Vec3f& get_rotation_axis() const
+private:
+	friend class Scene;
+
+	//How a Scene hears about its instances moving: each moved instance puts its index on the
+	//scene's list, once until the scene catches up. A copy doesn't belong to any scene.
+	class SceneLink
 	{
-		return _rotation_axis;
-	}
+	public:
+		std::vector<uint32_t>* moved_instances = nullptr;
+		uint32_t index = 0;
+		bool     moved = false;
+
+		SceneLink() = default;
+		SceneLink(const SceneLink&) {}
+		SceneLink& operator=(const SceneLink&) { return *this; }
+	};
 
-	void set_rotation(float rotation_angle, const Vec3f& rotation_axis)
+	//What get_model_view last worked out. A copy starts over, since its versions are its own.
+	class ModelViewCache
 	{
-		_rotation_angle = rotation_angle;
-		_rotation_axis = rotation_axis;
-		compute_transform();
-	}
+	public:
+		Mat      transform;
+		uint64_t camera_id = 0;
+		uint32_t world_version = 0;
 
-private:
-	Vec3f _translation;
-	float _scale; 
-	float _rotation_angle;
-	Vec3f _rotation_axis;
-	Mat	  _transform;
+		ModelViewCache() = default;
+		ModelViewCache(const ModelViewCache&) {}
+		ModelViewCache& operator=(const ModelViewCache&) { camera_id = 0; return *this; }
+	};
+
+	//Exactly one of these is set
+	const Model* _model = nullptr;
+	ModelHandle  _asset;
+
+	SceneLink _scene_link;
+	mutable ModelViewCache _model_view;
+	mutable size_t _lod_level = 0;
+
+	void on_world_changed() override
+	{
+		notify_scene();
+	}
 
-	void compute_transform() 
+	void notify_scene()
 	{
-		_transform = Mat::get_translation_matrix(_translation)
-			* Mat::get_scale_matrix(_scale)
-			* Mat::get_rotation_matrix(_rotation_angle, _rotation_axis);
+		if (_scene_link.moved_instances != nullptr && !_scene_link.moved)
+		{
+			_scene_link.moved = true;
+			_scene_link.moved_instances->push_back(_scene_link.index);
+		}
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Mat.h"
+#include "Vec.h"
+
+// A coarse copy of a finished frame's depths, for telling whether a whole instance is hidden in
+// the next frame before any of its triangles are transformed. Each cell of the bottom level holds
+// the farthest inverse Z in an 8x8 pixel block, 0 where anything in it was left empty, and each
+// level above holds the farthest of the 2x2 cells under it.
+//
+// The next frame's camera may have moved, so the captured cells are reprojected to it first: each
+// one's center is moved out to its farthest depth, through the world and back onto the new screen,
+// keeping the farthest of whatever lands in a cell. That is only an estimate. Cells nothing lands
+// in count as empty, and things that moved since the capture are still where they were, so an
+// instance can be hidden by mistake for a frame. Canvas looks again once the frame is drawn.
+class OcclusionBuffer
+{
+public:
+	static constexpr int cell_size = 8;
+
+	// Camera space points land on screen at (width / 2 + x / z * scale_x, height / 2 - y / z * scale_y)
+	OcclusionBuffer(size_t width, size_t height, float scale_x, float scale_y)
+		: _width(static_cast<int>(width))
+		, _height(static_cast<int>(height))
+		, _scale_x(scale_x)
+		, _scale_y(scale_y)
+	{
+		auto columns = (_width + cell_size - 1) / cell_size;
+		auto rows = (_height + cell_size - 1) / cell_size;
+		for (;;)
+		{
+			_levels.push_back({ columns, rows, std::vector<float>(static_cast<size_t>(columns) * rows, 0.0f) });
+			if (columns == 1 && rows == 1)
+				break;
+			columns = (columns + 1) / 2;
+			rows = (rows + 1) / 2;
+		}
+
+		_captured.assign(_levels[0].cells.size(), 0.0f);
+		_written.assign(_levels[0].cells.size(), 0);
+	}
+
+	// Takes the frame just drawn, farthest(column, row) giving each bottom cell's farthest inverse Z,
+	// along with where the camera was. Until the next reproject, tests are against this frame as is.
+	template <typename Farthest>
+	void capture(const Mat& camera_to_world, Farthest&& farthest)
+	{
+		auto& bottom = _levels[0];
+		for (auto row = 0; row < bottom.rows; ++row)
+		for (auto column = 0; column < bottom.columns; ++column)
+			_captured[static_cast<size_t>(row) * bottom.columns + column] = farthest(column, row);
+
+		_camera_to_world = camera_to_world;
+		_has_capture = true;
+		bottom.cells = _captured;
+		build_levels();
+	}
+
+	// Moves the last capture over to a camera that has the given world to camera transform
+	void reproject(const Mat& camera_transform)
+	{
+		auto& bottom = _levels[0];
+		std::fill(bottom.cells.begin(), bottom.cells.end(), 0.0f);
+		std::fill(_written.begin(), _written.end(), 0);
+
+		if (_has_capture)
+		{
+			auto old_to_new = camera_transform.multiply_affine(_camera_to_world);
+			for (auto row = 0; row < bottom.rows; ++row)
+			for (auto column = 0; column < bottom.columns; ++column)
+			{
+				auto inv_z = _captured[static_cast<size_t>(row) * bottom.columns + column];
+				if (inv_z <= 0)
+					continue;
+
+				auto z = 1 / inv_z;
+				auto x = (static_cast<float>((column * 2 + 1) * cell_size / 2) - static_cast<float>(_width / 2)) / _scale_x * z;
+				auto y = (static_cast<float>(_height / 2) - static_cast<float>((row * 2 + 1) * cell_size / 2)) / _scale_y * z;
+				auto moved = old_to_new.multiply_affine(Vec3f{ x, y, z });
+				if (moved.z <= 0)
+					continue;
+
+				auto screen_x = static_cast<float>(_width / 2) + moved.x / moved.z * _scale_x;
+				auto screen_y = static_cast<float>(_height / 2) - moved.y / moved.z * _scale_y;
+				if (!(screen_x >= 0 && screen_y >= 0 && screen_x < static_cast<float>(_width) && screen_y < static_cast<float>(_height)))
+					continue;
+
+				auto cell = static_cast<size_t>(static_cast<int>(screen_y) / cell_size) * bottom.columns
+					+ static_cast<int>(screen_x) / cell_size;
+				auto moved_inv_z = 1 / moved.z;
+				bottom.cells[cell] = _written[cell] != 0 ? std::min(bottom.cells[cell], moved_inv_z) : moved_inv_z;
+				_written[cell] = 1;
+			}
+
+			fill_gaps();
+		}
+
+		build_levels();
+	}
+
+	// Whether a camera space sphere is behind everything on screen wherever it could show up
+	bool is_hidden(const Vec3f& center, float radius) const
+	{
+		auto near_z = center.z - radius;
+		if (near_z <= 0)
+			return false;
+
+		// Every point of the sphere has x <= center.x + radius and z in [near_z, far_z], which
+		// bounds x / z whichever side of the axis it is on. Likewise for the rest.
+		auto far_z = center.z + radius;
+		auto right = (center.x + radius) / (center.x + radius > 0 ? near_z : far_z);
+		auto left = (center.x - radius) / (center.x - radius < 0 ? near_z : far_z);
+		auto top = (center.y + radius) / (center.y + radius > 0 ? near_z : far_z);
+		auto bottom = (center.y - radius) / (center.y - radius < 0 ? near_z : far_z);
+
+		auto half_width = static_cast<float>(_width / 2);
+		auto half_height = static_cast<float>(_height / 2);
+		auto min_x = std::max(0.0f, half_width + left * _scale_x);
+		auto max_x = std::min(static_cast<float>(_width - 1), half_width + right * _scale_x);
+		auto min_y = std::max(0.0f, half_height - top * _scale_y);
+		auto max_y = std::min(static_cast<float>(_height - 1), half_height - bottom * _scale_y);
+		if (min_x > max_x || min_y > max_y)
+			return false;
+
+		// The level where the sphere spans at most 2 cells each way, so only a few are read
+		size_t level = 0;
+		auto first_column = static_cast<int>(min_x) / cell_size;
+		auto last_column = static_cast<int>(max_x) / cell_size;
+		auto first_row = static_cast<int>(min_y) / cell_size;
+		auto last_row = static_cast<int>(max_y) / cell_size;
+		while (level + 1 < _levels.size() && std::max(last_column - first_column, last_row - first_row) > 1)
+		{
+			++level;
+			first_column /= 2;
+			last_column /= 2;
+			first_row /= 2;
+			last_row /= 2;
+		}
+
+		auto nearest = 1 / near_z;
+		auto& cells = _levels[level];
+		for (auto row = first_row; row <= last_row; ++row)
+		for (auto column = first_column; column <= last_column; ++column)
+		{
+			if (nearest >= cells.cells[static_cast<size_t>(row) * cells.columns + column])
+				return false;
+		}
+		return true;
+	}
+
+private:
+	class Level
+	{
+	public:
+		int columns;
+		int rows;
+		std::vector<float> cells;
+	};
+
+	const int   _width;
+	const int   _height;
+	const float _scale_x;
+	const float _scale_y;
+
+	std::vector<Level> _levels;
+
+	// The bottom level as captured, and the camera it was captured with
+	std::vector<float> _captured;
+	Mat                _camera_to_world = Mat::get_identity_matrix();
+	bool               _has_capture = false;
+
+	// Which bottom cells something was reprojected into
+	std::vector<uint8_t> _written;
+
+	// A cell that nothing landed in, but whose four neighbours all got something, is most likely
+	// a crack between them rather than something uncovered, and gets the farthest of them
+	void fill_gaps()
+	{
+		auto& bottom = _levels[0];
+		for (auto row = 1; row + 1 < bottom.rows; ++row)
+		for (auto column = 1; column + 1 < bottom.columns; ++column)
+		{
+			auto cell = static_cast<size_t>(row) * bottom.columns + column;
+			auto columns = static_cast<size_t>(bottom.columns);
+			if (_written[cell] != 0 || _written[cell - 1] == 0 || _written[cell + 1] == 0
+				|| _written[cell - columns] == 0 || _written[cell + columns] == 0)
+				continue;
+
+			bottom.cells[cell] = std::min({ bottom.cells[cell - 1], bottom.cells[cell + 1],
+				bottom.cells[cell - columns], bottom.cells[cell + columns] });
+		}
+	}
+
+	void build_levels()
+	{
+		for (size_t level = 1; level < _levels.size(); ++level)
+		{
+			auto& below = _levels[level - 1];
+			auto& above = _levels[level];
+			for (auto row = 0; row < above.rows; ++row)
+			for (auto column = 0; column < above.columns; ++column)
+			{
+				// Cells past the edge of the level below don't exist, rather than being empty
+				auto farthest = std::numeric_limits<float>::max();
+				for (auto y = row * 2; y < std::min(row * 2 + 2, below.rows); ++y)
+				for (auto x = column * 2; x < std::min(column * 2 + 2, below.columns); ++x)
+					farthest = std::min(farthest, below.cells[static_cast<size_t>(y) * below.columns + x]);
+				above.cells[static_cast<size_t>(row) * above.columns + column] = farthest;
+			}
+		}
+	}
+};
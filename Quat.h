@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cmath>
+
+#include "misc.h"
+#include "Mat.h"
+#include "Vec.h"
+
+// Unit quaternion holding a rotation. Two of them compose with 16 multiplies rather than a matrix
+// product, and turning one into a matrix takes no trig at all.
+class Quat
+{
+public:
+    float w ;
+    float x ;
+    float y ;
+    float z ;
+
+    static constexpr Quat get_identity()
+    {
+        return { 1, 0, 0, 0 } ;
+    }
+
+    // Turns the same way as Mat::get_rotation_matrix. The axis doesn't have to be unit length.
+    static Quat get_rotation( float degrees, const Vec3f& around )
+    {
+        auto vec_mag = std::sqrt( ( around.x * around.x ) + ( around.y * around.y ) + ( around.z * around.z ) ) ;
+
+        auto half_angle = degrees * pi / 360.0f ;
+        auto sin = std::sin( half_angle ) / vec_mag ;
+        return { std::cos( half_angle ), around.x * sin, around.y * sin, around.z * sin } ;
+    }
+
+    // Rotates by other first, then by this
+    Quat operator*( const Quat& other ) const
+    {
+        return { w * other.w - x * other.x - y * other.y - z * other.z,
+                 w * other.x + x * other.w + y * other.z - z * other.y,
+                 w * other.y - x * other.z + y * other.w + z * other.x,
+                 w * other.z + x * other.y - y * other.x + z * other.w } ;
+    }
+
+    // Back to unit length, so rounding doesn't build up over a long run of products
+    Quat normalize() const
+    {
+        auto length = std::sqrt( w * w + x * x + y * y + z * z ) ;
+        return { w / length, x / length, y / length, z / length } ;
+    }
+
+    Mat get_rotation_matrix() const
+    {
+        Mat output ;
+        output.elements[  0 ] = 1 - 2 * ( y * y + z * z ) ;
+        output.elements[  1 ] = 2 * ( x * y - w * z ) ;
+        output.elements[  2 ] = 2 * ( x * z + w * y ) ;
+        output.elements[  4 ] = 2 * ( x * y + w * z ) ;
+        output.elements[  5 ] = 1 - 2 * ( x * x + z * z ) ;
+        output.elements[  6 ] = 2 * ( y * z - w * x ) ;
+        output.elements[  8 ] = 2 * ( x * z - w * y ) ;
+        output.elements[  9 ] = 2 * ( y * z + w * x ) ;
+        output.elements[ 10 ] = 1 - 2 * ( x * x + y * y ) ;
+        output.elements[ 15 ] = 1 ;
+        return output ;
+    }
+} ;
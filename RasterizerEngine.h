@@ -0,0 +1,8 @@
+#pragma once
+
+// Which code fills the canvas' triangles
+enum class RasterizerEngine
+{
+	scanline,   // Walks the edges row by row, vertices snapped to whole pixels
+	half_space, // Edge functions over 8x8 blocks, subpixel vertices and a top-left fill rule
+};
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "misc.h"
+#include "ModelInstance.h"
+#include "Plane.h"
+#include "Vec.h"
+
+// Owns a set of instances and keeps them in a bounding volume hierarchy, so frustum culling
+// can throw away, or take, whole groups of them with one test.
+//
+// The hierarchy is rebuilt when instances are added or removed. Moving an instance, or anything
+// it hangs off, only refits the boxes above it, the next time refit() runs.
+class Scene
+{
+public:
+	// Instances hold on to their place in the scene, so a Scene can't be copied or moved
+	Scene() = default;
+	Scene(Scene const&) = delete;
+	Scene& operator=(Scene const&) = delete;
+
+	// Instances going away tell their children, which may be in here too, so they stop
+	// reporting moves first
+	~Scene()
+	{
+		for (auto& instance : _instances)
+			instance->_scene_link.moved_instances = nullptr;
+	}
+
+	// Adds a copy of the instance, which hangs off whatever the original does. None of the
+	// original's children come along, so a hierarchy has to be put together from what add()
+	// returns: pass the parent's returned instance to the overload below, or to set_parent.
+	// The returned instance stays put, so it can be moved about through the reference.
+	ModelInstance& add(const ModelInstance& instance)
+	{
+		return add(instance, instance.get_parent());
+	}
+
+	// Adds a copy of the instance hanging off parent instead, such as an instance add() returned
+	// earlier, or nullptr for a root
+	ModelInstance& add(const ModelInstance& instance, TransformNode* parent)
+	{
+		auto index = static_cast<uint32_t>(_instances.size());
+		_instances.push_back(std::make_unique<ModelInstance>(instance));
+
+		auto& added = *_instances.back();
+		added.set_parent(parent);
+		added._scene_link.moved_instances = &_moved_instances;
+		added._scene_link.index = index;
+
+		_needs_rebuild = true;
+		return added;
+	}
+
+	// The instance must be one add() returned. Whatever else refers to it goes stale.
+	void remove(ModelInstance& instance)
+	{
+		auto index = instance._scene_link.index;
+
+		std::swap(_instances[index], _instances.back());
+		_instances[index]->_scene_link.index = index;
+		_instances.pop_back();
+
+		_needs_rebuild = true;
+	}
+
+	size_t size() const
+	{
+		return _instances.size();
+	}
+
+	ModelInstance& operator[](size_t i)
+	{
+		return *_instances[i];
+	}
+
+	// Brings the hierarchy up to date with everything that moved, or finished loading,
+	// since the last time
+	void refit()
+	{
+		if (_needs_rebuild)
+		{
+			rebuild();
+			return;
+		}
+
+		// Loaded assets swap their placeholder bounds for real ones, which is as good as a move
+		auto still_loading = _loading_instances.begin();
+		for (auto index : _loading_instances)
+		{
+			if (_instances[index]->get_model() != nullptr)
+				_instances[index]->notify_scene();
+			else
+				*still_loading++ = index;
+		}
+		_loading_instances.erase(still_loading, _loading_instances.end());
+
+		if (_moved_instances.empty())
+			return;
+
+		for (auto index : _moved_instances)
+		{
+			_instances[index]->_scene_link.moved = false;
+			_instance_bounds[index] = compute_bounds(*_instances[index]);
+		}
+
+		// With lots of moves, one pass over every node beats walking up from each leaf.
+		// Children always come after their parents, so going backwards does the children first.
+		if (_moved_instances.size() * 8 > _nodes.size())
+		{
+			for (auto node = _nodes.size(); node-- > 0;)
+				refit_node(static_cast<uint32_t>(node));
+		}
+		else
+		{
+			for (auto index : _moved_instances)
+			{
+				for (auto node = _instance_leaves[index]; node != no_node; node = _parents[node])
+					refit_node(node);
+			}
+		}
+
+		_moved_instances.clear();
+	}
+
+	// Appends every instance that might be in front of all the planes, which must be in world
+	// space with unit normals. Call refit() first if anything has moved.
+	void cull(const Plane* planes, size_t plane_count, std::vector<const ModelInstance*>& visible) const
+	{
+		if (_nodes.empty())
+			return;
+
+		// Each entry carries the planes the node still has to be tested against. Once a box
+		// is entirely in front of a plane, so is everything under it.
+		struct Entry
+		{
+			uint32_t node;
+			uint32_t plane_mask;
+		};
+
+		Entry stack[64];
+		auto stack_size = 0;
+		stack[stack_size++] = { 0, (1u << plane_count) - 1 };
+
+		while (stack_size > 0)
+		{
+			auto entry = stack[--stack_size];
+			auto& node = _nodes[entry.node];
+			auto plane_mask = entry.plane_mask;
+
+			auto rejected = false;
+			for (size_t p = 0; p < plane_count && !rejected; ++p)
+			{
+				if ((plane_mask & (1u << p)) == 0)
+					continue;
+
+				// How far the box reaches toward the plane's normal, either way from its center
+				auto& plane = planes[p];
+				auto center = 0.5f * (node.box.min + node.box.max);
+				auto half_size = 0.5f * (node.box.max - node.box.min);
+				auto reach = std::abs(plane.normal.x) * half_size.x
+					+ std::abs(plane.normal.y) * half_size.y
+					+ std::abs(plane.normal.z) * half_size.z;
+				auto distance = compute_dot_product(plane.normal, center) + plane.distance;
+
+				if (distance < -reach)
+					rejected = true;
+				else if (distance > reach)
+					plane_mask &= ~(1u << p);
+			}
+
+			if (rejected)
+				continue;
+
+			if (node.count > 0 || plane_mask == 0)
+			{
+				append_instances(entry.node, visible);
+				continue;
+			}
+
+			stack[stack_size++] = { node.first, plane_mask };
+			stack[stack_size++] = { node.first + 1, plane_mask };
+		}
+	}
+
+private:
+	static constexpr uint32_t no_node = 0xFFFFFFFF;
+	static constexpr uint32_t max_leaf_size = 4;
+
+	class Box
+	{
+	public:
+		Vec3f min;
+		Vec3f max;
+	};
+
+	// A leaf holds count instances starting at first in _leaf_order. Anything else has no
+	// instances of its own, and its two children at first and first + 1.
+	class Node
+	{
+	public:
+		Box      box;
+		uint32_t first;
+		uint32_t count;
+	};
+
+	std::vector<std::unique_ptr<ModelInstance>> _instances{};
+	std::vector<uint32_t> _moved_instances{};
+	std::vector<uint32_t> _loading_instances{};
+	bool _needs_rebuild = false;
+
+	std::vector<Box>      _instance_bounds{};
+	std::vector<uint32_t> _instance_leaves{};
+	std::vector<uint32_t> _leaf_order{};
+	std::vector<Node>     _nodes{};
+	std::vector<uint32_t> _parents{};
+
+	static Box compute_bounds(const ModelInstance& instance)
+	{
+		auto& sphere = instance.get_bounding_sphere();
+		auto center = instance.get_transformation().multiply_affine(sphere.center);
+		auto radius = sphere.radius * instance.get_world_scale();
+		return {
+			{ center.x - radius, center.y - radius, center.z - radius },
+			{ center.x + radius, center.y + radius, center.z + radius } };
+	}
+
+	static void grow(Box& box, const Box& other)
+	{
+		box.min = { std::min(box.min.x, other.min.x), std::min(box.min.y, other.min.y), std::min(box.min.z, other.min.z) };
+		box.max = { std::max(box.max.x, other.max.x), std::max(box.max.y, other.max.y), std::max(box.max.z, other.max.z) };
+	}
+
+	void rebuild()
+	{
+		_needs_rebuild = false;
+
+		auto count = static_cast<uint32_t>(_instances.size());
+		_instance_bounds.resize(count);
+		_instance_leaves.resize(count);
+		_leaf_order.resize(count);
+		_moved_instances.clear();
+		_loading_instances.clear();
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			auto& instance = *_instances[i];
+			instance._scene_link.moved = false;
+			_instance_bounds[i] = compute_bounds(instance);
+			_leaf_order[i] = i;
+
+			if (instance.get_model() == nullptr)
+				_loading_instances.push_back(i);
+		}
+
+		_nodes.clear();
+		_parents.clear();
+		if (count == 0)
+			return;
+
+		_nodes.push_back({});
+		_parents.push_back(no_node);
+		build_node(0, 0, count);
+	}
+
+	// Splits the instances at the median of their centers along the longest side
+	void build_node(uint32_t node, uint32_t first, uint32_t count)
+	{
+		Box box = _instance_bounds[_leaf_order[first]];
+		Box centers = { get_center(_leaf_order[first]), get_center(_leaf_order[first]) };
+		for (auto i = first + 1; i < first + count; ++i)
+		{
+			grow(box, _instance_bounds[_leaf_order[i]]);
+			auto center = get_center(_leaf_order[i]);
+			grow(centers, { center, center });
+		}
+		_nodes[node].box = box;
+
+		auto extent = centers.max - centers.min;
+		if (count <= max_leaf_size || std::max({ extent.x, extent.y, extent.z }) <= 0)
+		{
+			_nodes[node].first = first;
+			_nodes[node].count = count;
+			for (auto i = first; i < first + count; ++i)
+				_instance_leaves[_leaf_order[i]] = node;
+			return;
+		}
+
+		auto axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+		auto half = count / 2;
+		std::nth_element(_leaf_order.begin() + first, _leaf_order.begin() + first + half,
+			_leaf_order.begin() + first + count, [&](uint32_t a, uint32_t b)
+		{
+			return get_axis(get_center(a), axis) < get_axis(get_center(b), axis);
+		});
+
+		auto children = static_cast<uint32_t>(_nodes.size());
+		_nodes[node].first = children;
+		_nodes[node].count = 0;
+		_nodes.push_back({});
+		_nodes.push_back({});
+		_parents.push_back(node);
+		_parents.push_back(node);
+
+		build_node(children, first, half);
+		build_node(children + 1, first + half, count - half);
+	}
+
+	void refit_node(uint32_t node)
+	{
+		auto& n = _nodes[node];
+		Box box;
+		if (n.count > 0)
+		{
+			box = _instance_bounds[_leaf_order[n.first]];
+			for (auto i = n.first + 1; i < n.first + n.count; ++i)
+				grow(box, _instance_bounds[_leaf_order[i]]);
+		}
+		else
+		{
+			box = _nodes[n.first].box;
+			grow(box, _nodes[n.first + 1].box);
+		}
+		n.box = box;
+	}
+
+	void append_instances(uint32_t node, std::vector<const ModelInstance*>& visible) const
+	{
+		auto& n = _nodes[node];
+		if (n.count > 0)
+		{
+			for (auto i = n.first; i < n.first + n.count; ++i)
+				visible.push_back(_instances[_leaf_order[i]].get());
+			return;
+		}
+
+		append_instances(n.first, visible);
+		append_instances(n.first + 1, visible);
+	}
+
+	Vec3f get_center(uint32_t instance) const
+	{
+		auto& box = _instance_bounds[instance];
+		return { (box.min.x + box.max.x) / 2, (box.min.y + box.max.y) / 2, (box.min.z + box.max.z) / 2 };
+	}
+
+	static float get_axis(const Vec3f& v, int axis)
+	{
+		return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+	}
+};
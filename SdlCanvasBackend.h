@@ -0,0 +1,81 @@
+#pragma once
+
+#include <SDL.h>
+#include <stdexcept>
+#include <string>
+
+#include "CanvasBackend.h"
+
+class SdlCanvasBackend final : public CanvasBackend
+{
+public:
+	SdlCanvasBackend(const char* window_title, size_t width, size_t height)
+		: CanvasBackend(width, height)
+	{
+		//Tell SDL we want to do stuff with the screen
+		if (SDL_Init(SDL_INIT_VIDEO) < 0)
+		{
+			//If it fails, throw an error
+			throw std::runtime_error(std::string("Could not initialize SDL2: ") + SDL_GetError());
+		}
+
+		//What is the window name, where to spawn it (x,y), width, height, how should the window start
+		_window = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+			static_cast<int>(width), static_cast<int>(height), SDL_WINDOW_SHOWN);
+
+		//If there is no pointer we failed
+		if (_window == nullptr)
+		{
+			throw std::runtime_error(std::string("Could not create window: ") + SDL_GetError());
+		}
+
+		//What window to use, index of the device (-1 means auto pick graphics card), 
+		//the flags we need to be supported,
+		_renderer = SDL_CreateRenderer(_window, -1, 0);
+
+		if (_renderer == nullptr)
+		{
+			SDL_DestroyWindow(_window);
+			throw std::runtime_error(std::string("Could not create renderer: ") + SDL_GetError());
+		}
+
+		//One streaming texture the size of the window, the whole frame is uploaded into it
+		_texture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+			static_cast<int>(width), static_cast<int>(height));
+
+		if (_texture == nullptr)
+		{
+			SDL_DestroyRenderer(_renderer);
+			SDL_DestroyWindow(_window);
+			throw std::runtime_error(std::string("Could not create texture: ") + SDL_GetError());
+		}
+	}
+
+	~SdlCanvasBackend() override
+	{
+		SDL_DestroyTexture(_texture);
+		SDL_DestroyRenderer(_renderer);
+		SDL_DestroyWindow(_window);
+	}
+
+	//One upload and one copy per frame instead of one draw call per pixel
+	void present(const uint32_t* pixels) override
+	{
+		SDL_UpdateTexture(_texture, nullptr, pixels,
+			static_cast<int>(_width * sizeof(uint32_t)));
+		SDL_RenderCopy(_renderer, _texture, nullptr, nullptr);
+		SDL_RenderPresent(_renderer);
+	}
+
+private:
+	SDL_Window* _window = nullptr;
+	SDL_Renderer* _renderer = nullptr;
+	SDL_Texture* _texture = nullptr;
+};
+
+inline bool should_keep_rendering()
+{
+	SDL_Event event;
+	SDL_PollEvent(&event);
+	return event.type != SDL_QUIT;
+}
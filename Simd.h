@@ -0,0 +1,17 @@
+#pragma once
+
+// Which instruction sets the compiler lets us use. Everything that uses them also has a plain
+// C++ fallback, written so compilers for other targets (NEON and so on) can vectorize it.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RASTERIZER_HAS_SSE2 1
+#include <emmintrin.h>
+#else
+#define RASTERIZER_HAS_SSE2 0
+#endif
+
+#if defined(__AVX__)
+#define RASTERIZER_HAS_AVX 1
+#include <immintrin.h>
+#else
+#define RASTERIZER_HAS_AVX 0
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include "AlignedAllocator.h"
+#include "Vec.h"
+
+// Vertex positions with one array per coordinate, so a batch of vertices fills a SIMD register
+// with a single load
+class SoaVertices
+{
+public:
+	// Vertices are transformed this many at a time, and every array is aligned for it
+	static constexpr size_t batch_size = 8;
+
+	using Array = std::vector<float, AlignedAllocator<float, batch_size * sizeof(float)>>;
+
+	Array x;
+	Array y;
+	Array z;
+
+	SoaVertices() = default;
+
+	// Pads with copies of the last vertex up to a whole number of batches, so batches never
+	// read past the end and the extra lanes still get sensible values
+	explicit SoaVertices(const std::vector<Vec3f>& vertices)
+	{
+		auto padded_size = (vertices.size() + batch_size - 1) / batch_size * batch_size;
+		x.reserve(padded_size);
+		y.reserve(padded_size);
+		z.reserve(padded_size);
+
+		for (auto& vertex : vertices)
+			push_back(vertex);
+
+		while (!vertices.empty() && size() < padded_size)
+			push_back(vertices.back());
+	}
+
+	size_t size() const
+	{
+		return x.size();
+	}
+
+	void clear()
+	{
+		x.clear();
+		y.clear();
+		z.clear();
+	}
+
+	void resize(size_t count)
+	{
+		x.resize(count);
+		y.resize(count);
+		z.resize(count);
+	}
+
+	void push_back(const Vec3f& vertex)
+	{
+		x.push_back(vertex.x);
+		y.push_back(vertex.y);
+		z.push_back(vertex.z);
+	}
+
+	Vec3f operator[](size_t i) const
+	{
+		return { x[i], y[i], z[i] };
+	}
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "HalfSpaceRasterizer.h"
+
+// Splits the screen into square tiles and keeps, for each tile, the triangles that may touch it.
+// Triangles are kept in the order they were binned, so each tile draws them in submission order.
+class TileGrid
+{
+public:
+	// The same tiles the canvas' buffers are stored in, so a tile only touches its own memory
+	static constexpr int tile_size = TiledLayout::tile_size;
+
+	TileGrid(size_t width, size_t height)
+		: _width(static_cast<int>(width))
+		, _height(static_cast<int>(height))
+		, _tiles_x((_width + tile_size - 1) / tile_size)
+		, _tiles_y((_height + tile_size - 1) / tile_size)
+		, _bins(static_cast<size_t>(_tiles_x) * _tiles_y)
+	{
+	}
+
+	size_t get_tile_count() const
+	{
+		return _bins.size();
+	}
+
+	const std::vector<uint32_t>& get_bin(size_t tile) const
+	{
+		return _bins[tile];
+	}
+
+	// Adds the triangle to every tile its (inclusive) screen bounding box overlaps
+	void bin(uint32_t triangle, int min_x, int min_y, int max_x, int max_y)
+	{
+		min_x = std::max(min_x, 0);
+		min_y = std::max(min_y, 0);
+		max_x = std::min(max_x, _width - 1);
+		max_y = std::min(max_y, _height - 1);
+
+		if (min_x > max_x || min_y > max_y)
+			return;
+
+		for (auto ty = min_y / tile_size; ty <= max_y / tile_size; ++ty)
+		for (auto tx = min_x / tile_size; tx <= max_x / tile_size; ++tx)
+			_bins[static_cast<size_t>(ty) * _tiles_x + tx].push_back(triangle);
+	}
+
+	// Empties the bins but keeps their memory for the next frame
+	void clear()
+	{
+		for (auto& bin : _bins)
+			bin.clear();
+	}
+
+	// Narrows the full-screen target's scissor rectangle down to one tile
+	template <typename Depth>
+	RasterTarget<Depth> get_tile_target(size_t tile, const RasterTarget<Depth>& screen) const
+	{
+		auto tx = static_cast<int>(tile % _tiles_x);
+		auto ty = static_cast<int>(tile / _tiles_x);
+
+		auto target = screen;
+		target.min_x = std::max(screen.min_x, tx * tile_size);
+		target.min_y = std::max(screen.min_y, ty * tile_size);
+		target.max_x = std::min(screen.max_x, tx * tile_size + tile_size - 1);
+		target.max_y = std::min(screen.max_y, ty * tile_size + tile_size - 1);
+		return target;
+	}
+
+private:
+	const int _width;
+	const int _height;
+	const int _tiles_x;
+	const int _tiles_y;
+	std::vector<std::vector<uint32_t>> _bins;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "AlignedAllocator.h"
+
+// Where each pixel of a tiled buffer lives. The screen is cut into square tiles, each tile into
+// 8x8 blocks laid out along a Z-order curve, and each block is stored row by row. So a block's
+// row is 8 pixels side by side, a block is a few cache lines on its own, and blocks that are near
+// each other on screen are near each other in memory, whichever way a triangle is walked.
+//
+// Buffers are padded out to whole tiles, so nothing needs to check for partial ones.
+class TiledLayout
+{
+public:
+	static constexpr int tile_size  = 64;
+	static constexpr int block_size = 8;
+
+	static constexpr int blocks_per_tile = (tile_size / block_size) * (tile_size / block_size);
+	static constexpr int block_pixels    = block_size * block_size;
+	static constexpr int tile_pixels     = tile_size * tile_size;
+
+	// Aligned to a cache line, so blocks never straddle one more than they have to
+	template <typename T>
+	using Buffer = std::vector<T, AlignedAllocator<T, 64>>;
+
+	TiledLayout(size_t width, size_t height)
+		: _width(static_cast<int>(width))
+		, _height(static_cast<int>(height))
+		, _tiles_x((_width + tile_size - 1) / tile_size)
+		, _tiles_y((_height + tile_size - 1) / tile_size)
+	{
+	}
+
+	size_t get_tile_count() const
+	{
+		return static_cast<size_t>(_tiles_x) * _tiles_y;
+	}
+
+	// Pixels in a buffer with this layout, padding included
+	size_t get_size() const
+	{
+		return get_tile_count() * tile_pixels;
+	}
+
+	// Where a block's row starts: x has to be the block's left edge, a multiple of block_size.
+	// The rest of the row follows it.
+	size_t get_block_row(int x, int y) const
+	{
+		auto tile = get_tile(x, y);
+		auto block = spread((x / block_size) % (tile_size / block_size))
+			| spread((y / block_size) % (tile_size / block_size)) << 1;
+		return tile * tile_pixels + block * block_pixels + static_cast<size_t>(y % block_size) * block_size;
+	}
+
+	size_t get_offset(int x, int y) const
+	{
+		return get_block_row(x - x % block_size, y) + x % block_size;
+	}
+
+	size_t get_tile(int x, int y) const
+	{
+		return static_cast<size_t>(y / tile_size) * _tiles_x + x / tile_size;
+	}
+
+	// Copies one tile's part of the screen out into a row-major buffer, a whole row of the tile at
+	// a time so the writes fill complete cache lines
+	template <typename T>
+	void resolve_tile(size_t tile, const T* tiled, T* linear) const
+	{
+		auto left = static_cast<int>(tile % _tiles_x) * tile_size;
+		auto top = static_cast<int>(tile / _tiles_x) * tile_size;
+		auto width = std::min(tile_size, _width - left);
+		auto height = std::min(tile_size, _height - top);
+		auto source = tiled + tile * tile_pixels;
+
+		for (auto y = 0; y < height; ++y)
+		{
+			auto destination = linear + static_cast<size_t>(top + y) * _width + left;
+			auto row = source + spread(y / block_size) * 2 * block_pixels + (y % block_size) * block_size;
+
+			// Whole block rows are a fixed size, which compilers turn into a couple of moves
+			auto x = 0;
+			for (; x + block_size <= width; x += block_size)
+				std::memcpy(destination + x, row + spread(x / block_size) * block_pixels, block_size * sizeof(T));
+
+			if (x < width)
+				std::memcpy(destination + x, row + spread(x / block_size) * block_pixels, (width - x) * sizeof(T));
+		}
+	}
+
+	// What resolve_tile would write for a tile that is value all over, without reading it
+	template <typename T>
+	void fill_tile(size_t tile, T value, T* linear) const
+	{
+		auto left = static_cast<int>(tile % _tiles_x) * tile_size;
+		auto top = static_cast<int>(tile / _tiles_x) * tile_size;
+		auto width = std::min(tile_size, _width - left);
+		auto height = std::min(tile_size, _height - top);
+
+		for (auto y = 0; y < height; ++y)
+		{
+			auto destination = linear + static_cast<size_t>(top + y) * _width + left;
+			std::fill(destination, destination + width, value);
+		}
+	}
+
+private:
+	const int _width;
+	const int _height;
+	const int _tiles_x;
+	const int _tiles_y;
+
+	// Spreads 3 bits out to every other bit
+	static size_t spread(int bits)
+	{
+		return static_cast<size_t>((bits & 1) | (bits & 2) << 1 | (bits & 4) << 2);
+	}
+
+};
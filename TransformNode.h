@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "Mat.h"
+#include "Quat.h"
+#include "Vec.h"
+
+// A translation, uniform scale and rotation, relative to an optional parent node. Changing any of
+// them only marks the node and everything under it out of date. The matrices are rebuilt the next
+// time someone asks for them, so the parts of a hierarchy that sit still cost nothing.
+//
+// Parents and children point at each other. A copy hangs off the same parent as the original but
+// starts without children, and a node that goes away leaves its children as roots.
+//
+// Asking for a matrix may update the node and its ancestors, so don't do that from several
+// threads at once for nodes that share any.
+class TransformNode
+{
+public:
+	explicit TransformNode(const Vec3f& translation = { 0, 0, 0 },
+		float scale = 1,
+		const Quat& rotation = Quat::get_identity())
+		: _translation(translation),
+		_scale(scale),
+		_rotation(rotation)
+	{
+	}
+
+	TransformNode(const TransformNode& other)
+		: _translation(other._translation),
+		_scale(other._scale),
+		_rotation(other._rotation)
+	{
+		attach_to(other._parent);
+	}
+
+	TransformNode& operator=(const TransformNode& other)
+	{
+		if (this != &other)
+		{
+			_translation = other._translation;
+			_scale = other._scale;
+			_rotation = other._rotation;
+			set_parent(other._parent);
+			mark_local_dirty();
+		}
+		return *this;
+	}
+
+	virtual ~TransformNode()
+	{
+		detach();
+		for (auto child : _children)
+		{
+			child->_parent = nullptr;
+			child->mark_world_dirty();
+		}
+	}
+
+	TransformNode* get_parent() const
+	{
+		return _parent;
+	}
+
+	//nullptr makes the node a root. The parent can't be the node itself or one of its children.
+	void set_parent(TransformNode* parent)
+	{
+		if (parent == _parent)
+			return;
+
+		detach();
+		attach_to(parent);
+		mark_world_dirty();
+	}
+
+	const Vec3f& get_translation() const
+	{
+		return _translation;
+	}
+
+	void set_translation(const Vec3f& translation)
+	{
+		_translation = translation;
+		mark_local_dirty();
+	}
+
+	float get_scale() const
+	{
+		return _scale;
+	}
+
+	void set_scale(float scale)
+	{
+		_scale = scale;
+		mark_local_dirty();
+	}
+
+	const Quat& get_rotation() const
+	{
+		return _rotation;
+	}
+
+	void set_rotation(const Quat& rotation)
+	{
+		_rotation = rotation;
+		mark_local_dirty();
+	}
+
+	void set_rotation(float rotation_angle, const Vec3f& rotation_axis)
+	{
+		set_rotation(Quat::get_rotation(rotation_angle, rotation_axis));
+	}
+
+	//Turns the node further, around an axis in its parent's space
+	void rotate(float rotation_angle, const Vec3f& rotation_axis)
+	{
+		set_rotation((Quat::get_rotation(rotation_angle, rotation_axis) * _rotation).normalize());
+	}
+
+	//Relative to the parent
+	const Mat& get_local_transform() const
+	{
+		if (_local_dirty)
+		{
+			_local = Mat::get_translation_matrix(_translation)
+				.multiply_affine(Mat::get_scale_matrix(_scale))
+				.multiply_affine(_rotation.get_rotation_matrix());
+			_local_dirty = false;
+		}
+		return _local;
+	}
+
+	const Mat& get_world_transform() const
+	{
+		update_world();
+		return _world;
+	}
+
+	//The scales of the node and all of its ancestors, multiplied together
+	float get_world_scale() const
+	{
+		update_world();
+		return _world_scale;
+	}
+
+	//Changes whenever the world transform is rebuilt, for anything that caches results made from it
+	uint32_t get_world_version() const
+	{
+		update_world();
+		return _world_version;
+	}
+
+protected:
+	//Called once each time the world transform goes out of date
+	virtual void on_world_changed()
+	{
+	}
+
+private:
+	TransformNode* _parent = nullptr;
+	std::vector<TransformNode*> _children;
+
+	Vec3f _translation;
+	float _scale;
+	Quat  _rotation;
+
+	mutable Mat      _local;
+	mutable Mat      _world;
+	mutable float    _world_scale = 1;
+	mutable uint32_t _world_version = 0;
+	mutable bool     _local_dirty = true;
+	mutable bool     _world_dirty = true;
+
+	void update_world() const
+	{
+		if (!_world_dirty)
+			return;
+
+		// A dirty parent always has dirty children, so a clean one can be used as it is
+		if (_parent != nullptr)
+		{
+			_world = _parent->get_world_transform().multiply_affine(get_local_transform());
+			_world_scale = _parent->_world_scale * _scale;
+		}
+		else
+		{
+			_world = get_local_transform();
+			_world_scale = _scale;
+		}
+
+		++_world_version;
+		_world_dirty = false;
+	}
+
+	void mark_local_dirty()
+	{
+		_local_dirty = true;
+		mark_world_dirty();
+	}
+
+	// Whatever is under a node that is already dirty is dirty too, so there is no need to go on
+	void mark_world_dirty()
+	{
+		if (_world_dirty)
+			return;
+
+		_world_dirty = true;
+		on_world_changed();
+		for (auto child : _children)
+			child->mark_world_dirty();
+	}
+
+	void attach_to(TransformNode* parent)
+	{
+		_parent = parent;
+		if (_parent != nullptr)
+			_parent->_children.push_back(this);
+	}
+
+	void detach()
+	{
+		if (_parent == nullptr)
+			return;
+
+		auto& siblings = _parent->_children;
+		siblings.erase(std::find(siblings.begin(), siblings.end(), this));
+		_parent = nullptr;
+	}
+};
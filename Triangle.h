@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include "Vec.h"
 #include "Color.h"
 
@@ -8,4 +10,16 @@ class Triangle
 public:
 	Vec3i vertex_indices;
 	Color color;
-};
\ No newline at end of file
+};
+
+// Color's channels are const, so triangles can't be assigned, or sorted in place, and a mesh's
+// have to be built one at a time. make_triangle(i) gives the i-th of the count.
+template <typename MakeTriangle>
+std::vector<Triangle> make_triangles(size_t count, MakeTriangle&& make_triangle)
+{
+	std::vector<Triangle> triangles;
+	triangles.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+		triangles.push_back(make_triangle(i));
+	return triangles;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Mat.h"
+#include "Simd.h"
+#include "SoaVertices.h"
+
+// Moves a model's vertices into camera space and projects them onto the canvas in one pass,
+// SoaVertices::batch_size vertices per iteration.
+class VertexTransform
+{
+public:
+	// Applies the transform's top three rows to vertices [first, first + count) of input, both being
+	// whole numbers of batches, and writes the results to the same spots in output and screen_x/y:
+	//
+	//    screen = (x, y) * projection_plane_z / z * screen_scale
+	//
+	// The screen arrays must be aligned like SoaVertices' arrays. Vertices at or behind the camera
+	// get meaningless screen positions; they only matter for triangles the clipper rebuilds anyway.
+	static void transform_and_project(const Mat& transform, const SoaVertices& input, size_t first, size_t count,
+		SoaVertices& output, float* screen_x, float* screen_y,
+		float projection_plane_z, float screen_scale_x, float screen_scale_y)
+	{
+		auto& m = transform.elements;
+		auto i = first;
+		auto end = first + count;
+
+#if RASTERIZER_HAS_AVX
+		__m256 rows[12];
+		for (auto e = 0; e < 12; ++e)
+			rows[e] = _mm256_set1_ps(m[e]);
+		auto plane_z = _mm256_set1_ps(projection_plane_z);
+		auto scale_x = _mm256_set1_ps(screen_scale_x);
+		auto scale_y = _mm256_set1_ps(screen_scale_y);
+
+		for (; i < end; i += SoaVertices::batch_size)
+		{
+			auto x = _mm256_load_ps(input.x.data() + i);
+			auto y = _mm256_load_ps(input.y.data() + i);
+			auto z = _mm256_load_ps(input.z.data() + i);
+
+			auto tx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rows[0], x),
+				_mm256_mul_ps(rows[1], y)), _mm256_mul_ps(rows[2], z)), rows[3]);
+			auto ty = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rows[4], x),
+				_mm256_mul_ps(rows[5], y)), _mm256_mul_ps(rows[6], z)), rows[7]);
+			auto tz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rows[8], x),
+				_mm256_mul_ps(rows[9], y)), _mm256_mul_ps(rows[10], z)), rows[11]);
+
+			_mm256_store_ps(output.x.data() + i, tx);
+			_mm256_store_ps(output.y.data() + i, ty);
+			_mm256_store_ps(output.z.data() + i, tz);
+			_mm256_store_ps(screen_x + i, _mm256_mul_ps(_mm256_div_ps(_mm256_mul_ps(tx, plane_z), tz), scale_x));
+			_mm256_store_ps(screen_y + i, _mm256_mul_ps(_mm256_div_ps(_mm256_mul_ps(ty, plane_z), tz), scale_y));
+		}
+#elif RASTERIZER_HAS_SSE2
+		__m128 rows[12];
+		for (auto e = 0; e < 12; ++e)
+			rows[e] = _mm_set1_ps(m[e]);
+		auto plane_z = _mm_set1_ps(projection_plane_z);
+		auto scale_x = _mm_set1_ps(screen_scale_x);
+		auto scale_y = _mm_set1_ps(screen_scale_y);
+
+		// Two registers' worth per batch
+		for (; i < end; i += 4)
+		{
+			auto x = _mm_load_ps(input.x.data() + i);
+			auto y = _mm_load_ps(input.y.data() + i);
+			auto z = _mm_load_ps(input.z.data() + i);
+
+			auto tx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rows[0], x),
+				_mm_mul_ps(rows[1], y)), _mm_mul_ps(rows[2], z)), rows[3]);
+			auto ty = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rows[4], x),
+				_mm_mul_ps(rows[5], y)), _mm_mul_ps(rows[6], z)), rows[7]);
+			auto tz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rows[8], x),
+				_mm_mul_ps(rows[9], y)), _mm_mul_ps(rows[10], z)), rows[11]);
+
+			_mm_store_ps(output.x.data() + i, tx);
+			_mm_store_ps(output.y.data() + i, ty);
+			_mm_store_ps(output.z.data() + i, tz);
+			_mm_store_ps(screen_x + i, _mm_mul_ps(_mm_div_ps(_mm_mul_ps(tx, plane_z), tz), scale_x));
+			_mm_store_ps(screen_y + i, _mm_mul_ps(_mm_div_ps(_mm_mul_ps(ty, plane_z), tz), scale_y));
+		}
+#else
+		auto in_x = input.x.data();
+		auto in_y = input.y.data();
+		auto in_z = input.z.data();
+		auto out_x = output.x.data();
+		auto out_y = output.y.data();
+		auto out_z = output.z.data();
+
+		// Fixed-length inner loop with no dependencies between lanes, for the auto-vectorizer
+		for (; i < end; i += SoaVertices::batch_size)
+		for (size_t j = i; j < i + SoaVertices::batch_size; ++j)
+		{
+			auto tx = m[0] * in_x[j] + m[1] * in_y[j] + m[2] * in_z[j] + m[3];
+			auto ty = m[4] * in_x[j] + m[5] * in_y[j] + m[6] * in_z[j] + m[7];
+			auto tz = m[8] * in_x[j] + m[9] * in_y[j] + m[10] * in_z[j] + m[11];
+
+			out_x[j] = tx;
+			out_y[j] = ty;
+			out_z[j] = tz;
+			screen_x[j] = tx * projection_plane_z / tz * screen_scale_x;
+			screen_y[j] = ty * projection_plane_z / tz * screen_scale_y;
+		}
+#endif
+	}
+};
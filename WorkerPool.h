@@ -0,0 +1,178 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that run the indices of one parallel_for at a time.
+// The calling thread works too, so a pool of one thread just runs everything inline.
+//
+// Each worker starts with its own contiguous slice of the indices and takes them from the front.
+// A worker that runs dry steals the back half of another worker's slice, so neighbouring indices
+// tend to stay on one thread and threads only touch each other's slices when the load is uneven.
+class WorkerPool
+{
+public:
+	explicit WorkerPool(size_t thread_count)
+		: _thread_count(thread_count > 0 ? thread_count : 1)
+		, _slices(_thread_count)
+	{
+		for (size_t worker = 1; worker < _thread_count; ++worker)
+			_threads.emplace_back([this, worker] { worker_main(worker); });
+	}
+
+	WorkerPool(WorkerPool const&) = delete;
+	WorkerPool operator = (WorkerPool const&) = delete;
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_wake.notify_all();
+
+		for (auto& thread : _threads)
+			thread.join();
+	}
+
+	size_t get_thread_count() const
+	{
+		return _thread_count;
+	}
+
+	// Calls task(index, worker) for every index in [0, count) and returns once they are all done.
+	// worker is in [0, get_thread_count()) and is never shared by two tasks running at once,
+	// so it can pick a per-thread output buffer.
+	void parallel_for(size_t count, const std::function<void(size_t, size_t)>& task)
+	{
+		if (_threads.empty() || count <= 1)
+		{
+			for (size_t i = 0; i < count; ++i)
+				task(i, 0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_task = &task;
+			for (size_t worker = 0; worker < _thread_count; ++worker)
+				_slices[worker].store(pack(count * worker / _thread_count, count * (worker + 1) / _thread_count));
+			_busy_threads = _threads.size();
+			++_generation;
+		}
+		_wake.notify_all();
+
+		run_tasks(0);
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_done.wait(lock, [this] { return _busy_threads == 0; });
+		_task = nullptr;
+	}
+
+private:
+	const size_t _thread_count;
+	std::vector<std::thread> _threads;
+
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _done;
+	bool _stopping = false;
+	size_t _generation = 0;
+	size_t _busy_threads = 0;
+
+	const std::function<void(size_t, size_t)>* _task = nullptr;
+
+	// Each worker's remaining indices, [begin, end) packed into one word so both ends move atomically
+	std::vector<std::atomic<uint64_t>> _slices;
+
+	static uint64_t pack(uint64_t begin, uint64_t end)
+	{
+		return (begin << 32) | end;
+	}
+
+	static uint32_t get_begin(uint64_t slice)
+	{
+		return static_cast<uint32_t>(slice >> 32);
+	}
+
+	static uint32_t get_end(uint64_t slice)
+	{
+		return static_cast<uint32_t>(slice);
+	}
+
+	void worker_main(size_t worker)
+	{
+		size_t seen_generation = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [&] { return _stopping || _generation != seen_generation; });
+				if (_stopping)
+					return;
+				seen_generation = _generation;
+			}
+
+			run_tasks(worker);
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (--_busy_threads == 0)
+				_done.notify_one();
+		}
+	}
+
+	void run_tasks(size_t worker)
+	{
+		size_t index;
+		for (;;)
+		{
+			if (pop_front(worker, index))
+				(*_task)(index, worker);
+			else if (!steal(worker))
+				return;
+		}
+	}
+
+	bool pop_front(size_t worker, size_t& index)
+	{
+		auto& slice = _slices[worker];
+		auto current = slice.load();
+		while (get_begin(current) < get_end(current))
+		{
+			if (slice.compare_exchange_weak(current, pack(get_begin(current) + 1, get_end(current))))
+			{
+				index = get_begin(current);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Moves the back half of the first non-empty slice found into this worker's (empty) slice
+	bool steal(size_t thief)
+	{
+		for (size_t offset = 1; offset < _thread_count; ++offset)
+		{
+			auto& victim = _slices[(thief + offset) % _thread_count];
+			auto current = victim.load();
+			while (get_begin(current) < get_end(current))
+			{
+				auto begin = get_begin(current);
+				auto end = get_end(current);
+				auto middle = end - (end - begin + 1) / 2;
+				if (victim.compare_exchange_weak(current, pack(begin, middle)))
+				{
+					_slices[thief].store(pack(middle, end));
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+};
@@ -1,26 +1,67 @@
 #include "misc.h"
 #include "Canvas.h"
 #include "A3DBModel.h"
+#include "BinaryModel.h"
+#include "MatBenchmark.h"
+#include "ModelCache.h"
+#include "SdlCanvasBackend.h"
 #include<iostream>
+#include<string>
+#include<vector>
 
 int main(int argc, char* argv[])
 {
+	//Pass --convert <in.a3db> <out.a3mb> to write a model out in the binary format and exit
+	if (argc == 4 && std::string(argv[1]) == "--convert")
+	{
+		try
+		{
+			if (BinaryModel::save(*A3DBModel::load(argv[2]), argv[3]))
+				return 0;
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << e.what() << std::endl;
+		}
 
-	Canvas c("", 600, 600);
+		std::cout << "Failed to convert model!" << std::endl;
+		return -1;
+	}
 
-	auto cube = A3DBModel::load("cube.a3db");
+	//Pass --bench-mat to time the matrix products with and without SSE2 and exit
+	if (argc == 2 && std::string(argv[1]) == "--bench-mat")
+	{
+		MatBenchmark::run(std::cout);
+		return 0;
+	}
 
-	if (cube == nullptr)
+	Canvas c(std::make_unique<SdlCanvasBackend>("", 600, 600));
+
+	//Pass --half-space to try the edge function rasterizer instead of the scanline one,
+	//--guard-band to only clip triangles that reach well past the edges of the screen,
+	//and --depth-24 or --depth-16 to keep depth in fixed point instead of floats
+	for (int i = 1; i < argc; ++i)
 	{
-		std::cout << "Failed to load model!" << std::endl;
-		return -1;
+		if (std::string(argv[i]) == "--half-space")
+			c.set_rasterizer_engine(RasterizerEngine::half_space);
+		else if (std::string(argv[i]) == "--guard-band")
+			c.set_guard_band_clipping(true);
+		else if (std::string(argv[i]) == "--depth-24")
+			c.set_depth_format(DepthFormat::unorm24);
+		else if (std::string(argv[i]) == "--depth-16")
+			c.set_depth_format(DepthFormat::unorm16);
 	}
 
-	ModelInstance cube_instance_1{ *cube, {-1.5, 0, 7}, .75 };
+	//Loads in the background, the instances show up once it is in. Until then the cube is
+	//known to fit in a sphere of radius 2.
+	ModelCache models;
+	auto cube = models.load("cube.a3db", { { 0, 0, 0 }, 2 });
+
+	ModelInstance cube_instance_1{ cube, {-1.5, 0, 7}, .75 };
 
-	ModelInstance cube_instance_2{ *cube, {1.25, 2.5, 7.5}, 1, 195, {0,1,0} };
+	ModelInstance cube_instance_2{ cube, {1.25, 2.5, 7.5}, 1, 195, {0,1,0} };
 
-	ModelInstance cube_instance_3{ *cube, {-1.5, 1, 0 } };
+	ModelInstance cube_instance_3{ cube, {-1.5, 1, 0 } };
 
 	c.set_camera_position({ -3, 1, 2 });
 	c.set_camera_orientation(Mat::get_rotation_matrix(30, { 0,1,0 }));
@@ -29,23 +70,36 @@ int main(int argc, char* argv[])
 
 
 	float rotator = 0;
+	float cube_2_angle = 195;
+	std::vector<Mat> cube_transforms;
 
 	while (should_keep_rendering())
 	{
+		if (cube->get_state() == ModelAsset::State::failed)
+		{
+			std::cout << "Failed to load model! " << cube->get_error() << std::endl;
+			return -1;
+		}
+
 		c.clear();
 		//C++ automatically figures out that with 2 parameters it can make a Vec2i because it expects one
 
 		rotator += .25f;
 
-		cube_instance_1.set_rotation(cube_instance_1.get_rotation_angle() + 2, {1,1,1});
+		cube_instance_1.rotate(2, {1,1,1});
 		cube_instance_1.set_translation({ -1.5, static_cast<float>(std::sin(rotator)/2), 7 });
 
-		cube_instance_2.set_rotation(cube_instance_2.get_rotation_angle() + 2, { 0,0,1 });
+		//Spun to an absolute angle around z, which replaces the rotation it started with
+		cube_2_angle += 2;
+		cube_instance_2.set_rotation(cube_2_angle, { 0,0,1 });
 
 		//Order super matters on matrix math!!!
-		c.draw_simple_model(cube_instance_1);
-		c.draw_simple_model(cube_instance_2);
-		c.draw_simple_model(cube_instance_3);
+		//All three are the same cube, so they can go through in one call once it has loaded
+		if (auto cube_model = cube->get_model())
+		{
+			cube_transforms = { cube_instance_1.get_transformation(), cube_instance_2.get_transformation(), cube_instance_3.get_transformation() };
+			c.draw_instanced(*cube_model, cube_transforms);
+		}
 
 
 		